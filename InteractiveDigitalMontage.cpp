@@ -204,6 +204,8 @@ void InteractiveDigitalMontage::appendSourceImages()
         {
             imgW = img.width();
             imgH = img.height();
+            previewScale = MontageCore::CoarseScale(imgW, imgH,
+                labelMatchSettings().PreviewMaxPixels);
         }
         if (img.width() != imgW
             || img.height() != imgH)
@@ -216,6 +218,11 @@ void InteractiveDigitalMontage::appendSourceImages()
         }
 
         srcImgs.push_back(img);
+        previewImgs.push_back(img.scaled(
+            (imgW + previewScale - 1) / previewScale,
+            (imgH + previewScale - 1) / previewScale,
+            Qt::IgnoreAspectRatio, Qt::SmoothTransformation
+        ));
         srcImgNames.push_back(fn);
         srcImgLblCols.push_back(
             QColor(rand() % 255, rand() % 255, rand() % 255)
@@ -242,6 +249,7 @@ void InteractiveDigitalMontage::clearSourceImages()
     }
 
     srcImgs.clear();
+    previewImgs.clear();
     srcImgNames.clear();
     srcImgLblCols.clear();
     designatedLbls.clear();
@@ -374,6 +382,7 @@ void InteractiveDigitalMontage::appendInteractiveLabel()
     changeCurrSrcIdxTo(currSrcIdx);
 
     state = MainState::SourceImageLoaded;
+    requestPreview();
 }
 
 void InteractiveDigitalMontage::eraseInteractiveLabel()
@@ -417,6 +426,7 @@ void InteractiveDigitalMontage::eraseInteractiveLabel()
     changeCurrSrcIdxTo(currSrcIdx);
 
     state = MainState::SourceImageLoaded;
+    requestPreview();
 }
 
 void InteractiveDigitalMontage::clearDesignatedLabels()
@@ -500,11 +510,12 @@ void InteractiveDigitalMontage::runLabelMatching()
     case MainState::Labeling:
     case MainState::GradientFusing:
         textEditSetText(
-            ui.textEditLblMatchRslts, tr("A Thread is Running Now, Please Wait"),
+            ui.textEditLblMatchRslts, tr("Cancelled the Running Thread"),
             Qt::GlobalColor::red, false
         );
-        return;
+        // fall through to start a new Label Match
     default:
+        cancelRunningWorkers();
         // enetr Labeling state
         // to avoid duplicate calls of this func
         textEditSetText(
@@ -526,32 +537,86 @@ void InteractiveDigitalMontage::runLabelMatching()
             + QString::fromStdString(std::to_string(ui.doubleSpinBoxDatTermAlpha->value())),
             Qt::GlobalColor::black, false
         );
+        textEditSetText(
+            ui.textEditLblMatchRslts, tr("Label Match Mode is: ")
+            + ui.comboBoxLblMatchMode->currentText(),
+            Qt::GlobalColor::black, false
+        );
+        textEditSetText(
+            ui.textEditLblMatchRslts, tr("Graph Precision is: ")
+            + ui.comboBoxGraphPrecision->currentText(),
+            Qt::GlobalColor::black, false
+        );
+        textEditSetText(
+            ui.textEditLblMatchRslts, tr("Time Budget is: ")
+            + QString::fromStdString(std::to_string(ui.doubleSpinBoxTimeBudget->value())),
+            Qt::GlobalColor::black, false
+        );
+        textEditSetText(
+            ui.textEditLblMatchRslts, tr("Min Improvement is: ")
+            + QString::fromStdString(std::to_string(ui.doubleSpinBoxMinImprovement->value())),
+            Qt::GlobalColor::black, false
+        );
+        textEditSetText(
+            ui.textEditLblMatchRslts, tr("Memory Budget is: ")
+            + QString::fromStdString(std::to_string(ui.doubleSpinBoxMemoryBudget->value())) + " GB",
+            Qt::GlobalColor::black, false
+        );
+        textEditSetText(
+            ui.textEditLblMatchRslts, tr("Inertia Weight is: ")
+            + QString::fromStdString(std::to_string(ui.doubleSpinBoxInertiaWeight->value())),
+            Qt::GlobalColor::black, false
+        );
         this->state = MainState::Labeling;
         break;
     }
 
-    MontageLabelMatchWorker* worker =
+    MontageLabelMatchWorker* worker = lblMatchWorker =
         new MontageLabelMatchWorker(
             srcImgs, designatedLbls, srcImgLblCols,
             ui.doubleSpinBoxDatTermLrgPnlty->value(),
             ui.doubleSpinBoxDatTermAlpha->value(),
-            ui.comboBoxSmoothTermType->currentIndex()
+            ui.comboBoxSmoothTermType->currentIndex(),
+            ui.comboBoxLblMatchMode->currentIndex(),
+            ui.comboBoxGraphPrecision->currentIndex(),
+            ui.doubleSpinBoxTimeBudget->value(),
+            ui.doubleSpinBoxMinImprovement->value(),
+            labelMatchSettings()
         );
 
     // run label match in another thread
+    connect(worker, &MontageLabelMatchWorker::progressReady,
+        this, &InteractiveDigitalMontage::handleLblMatchProgress);
     connect(worker, &MontageLabelMatchWorker::resultReady,
         this, &InteractiveDigitalMontage::handleLblMatchRslt);
     connect(worker, &MontageLabelMatchWorker::finished,
         worker, &QObject::deleteLater);
-    worker->start(QThread::TimeCriticalPriority);
+    startWorker(worker, QThread::TimeCriticalPriority);
+}
+
+void InteractiveDigitalMontage::handleLblMatchProgress(const MontageLabelMatchResult& result)
+{
+    // a stale progress of a finished or cancelled Label Match is dropped
+    if (state != MainState::Labeling || sender() != lblMatchWorker)
+        return;
+    loadLblMatchRslts(result);
 }
 
 void InteractiveDigitalMontage::handleLblMatchRslt(const MontageLabelMatchResult& result)
 {
+    if (sender() != lblMatchWorker)
+        return;
+    lblMatchWorker = nullptr;
     textEditSetText(
         ui.textEditLblMatchRslts, result.msg,
         Qt::GlobalColor::black, false
     );
+    loadLblMatchRslts(result);
+    this->state = MainState::Labeled;
+}
+
+void InteractiveDigitalMontage::loadLblMatchRslts(const MontageLabelMatchResult& result)
+{
     LMRslts[0] = result.expndLbl;
     LMRslts[1] = result.img;
     
@@ -579,7 +644,6 @@ void InteractiveDigitalMontage::handleLblMatchRslt(const MontageLabelMatchResult
 
     currLMRsltIdx = 0;
     ui.graphicsViewLblMatchRslts->loadBackgroudImage(LMRslts[currLMRsltIdx]);
-    this->state = MainState::Labeled;
 }
 
 void InteractiveDigitalMontage::switchLblMatchRslts()
@@ -638,6 +702,113 @@ void InteractiveDigitalMontage::exportLblMatchRslt()
         );
 }
 
+void InteractiveDigitalMontage::cancelRunningWorkers()
+{
+    if (!lblMatchWorker.isNull())
+    {
+        lblMatchWorker->cancel();
+        retireWorker(lblMatchWorker);
+        lblMatchWorker = nullptr;
+    }
+    if (!gradFuseWorker.isNull())
+    {
+        gradFuseWorker->cancel();
+        retireWorker(gradFuseWorker);
+        gradFuseWorker = nullptr;
+    }
+    if (!previewWorker.isNull())
+    {
+        previewWorker->cancel();
+        retireWorker(previewWorker);
+        previewWorker = nullptr;
+    }
+    previewPending = false;
+}
+
+void InteractiveDigitalMontage::retireWorker(QThread* worker)
+{
+    // a worker waiting for its start is never started
+    if (worker == pendingWorker)
+    {
+        pendingWorker = nullptr;
+        worker->deleteLater();
+        return;
+    }
+    retiringWorkers.push_back(worker);
+}
+
+void InteractiveDigitalMontage::startWorker(QThread* worker, QThread::Priority priority)
+{
+    connect(worker, &QThread::finished,
+        this, &InteractiveDigitalMontage::handleWorkerFinished);
+    if (retiringWorkers.isEmpty())
+    {
+        worker->start(priority);
+        return;
+    }
+    pendingWorker = worker;
+    pendingPriority = priority;
+}
+
+void InteractiveDigitalMontage::handleWorkerFinished()
+{
+    // the sender is only compared, it may be deleted by now
+    retiringWorkers.removeAll(static_cast<QThread*>(sender()));
+    if (!retiringWorkers.isEmpty() || pendingWorker.isNull())
+        return;
+    QThread* worker = pendingWorker;
+    pendingWorker = nullptr;
+    worker->start(pendingPriority);
+}
+
+void InteractiveDigitalMontage::requestPreview()
+{
+    if (!ui.checkBoxLivePreview->isChecked() || state != MainState::SourceImageLoaded)
+        return;
+    // the running preview is let finish, since a preview is quick
+    if (!previewWorker.isNull())
+    {
+        previewPending = true;
+        return;
+    }
+    previewPending = false;
+
+    MontagePreviewWorker* worker = previewWorker =
+        new MontagePreviewWorker(
+            previewImgs, designatedLbls, srcImgLblCols,
+            previewScale, imgW, imgH,
+            ui.doubleSpinBoxDatTermLrgPnlty->value(),
+            ui.doubleSpinBoxDatTermAlpha->value(),
+            ui.comboBoxSmoothTermType->currentIndex(),
+            labelMatchSettings()
+        );
+
+    connect(worker, &MontagePreviewWorker::resultReady,
+        this, &InteractiveDigitalMontage::handlePreviewRslt);
+    connect(worker, &MontagePreviewWorker::finished,
+        this, &InteractiveDigitalMontage::handlePreviewFinished);
+    connect(worker, &MontagePreviewWorker::finished,
+        worker, &QObject::deleteLater);
+    startWorker(worker, QThread::InheritPriority);
+}
+
+void InteractiveDigitalMontage::handlePreviewRslt(const MontageLabelMatchResult& result)
+{
+    // a preview is dropped once a Label Match is started
+    if (sender() != previewWorker || state != MainState::SourceImageLoaded)
+        return;
+    loadLblMatchRslts(result);
+}
+
+void InteractiveDigitalMontage::handlePreviewFinished()
+{
+    if (sender() != previewWorker)
+        return;
+    previewWorker = nullptr;
+    if (previewPending)
+        requestPreview();
+}
+
 void InteractiveDigitalMontage::runGradientFuse()
 {
     switch (state)
@@ -655,13 +826,19 @@ void InteractiveDigitalMontage::runGradientFuse()
         );
         return;
     case MainState::Labeling:
-    case MainState::GradientFusing:
         textEditSetText(
             ui.textEditGradFuseRslts, tr("A Thread is Running Now, Please Wait"),
             Qt::GlobalColor::red, false
         );
         return;
+    case MainState::GradientFusing:
+        textEditSetText(
+            ui.textEditGradFuseRslts, tr("Cancelled the Running Thread"),
+            Qt::GlobalColor::red, false
+        );
+        // fall through to start a new Gradient Fusion
     default:
+        cancelRunningWorkers();
         // enetr Labeling state
         // to avoid duplicate calls of this func
         textEditSetText(
@@ -677,7 +854,7 @@ void InteractiveDigitalMontage::runGradientFuse()
         break;
     }
 
-    MontageGradientFusionWorker* worker =
+    MontageGradientFusionWorker* worker = gradFuseWorker =
         new MontageGradientFusionWorker(ui.comboBoxGradFuseSolver->currentIndex());
 
     // run gradient fusion in another thread
@@ -685,11 +862,14 @@ void InteractiveDigitalMontage::runGradientFuse()
         this, &InteractiveDigitalMontage::handleGradFuseRslt);
     connect(worker, &MontageGradientFusionWorker::finished,
         worker, &QObject::deleteLater);
-    worker->start(QThread::TimeCriticalPriority);
+    startWorker(worker, QThread::TimeCriticalPriority);
 }
 
 void InteractiveDigitalMontage::handleGradFuseRslt(const MontageGradientFusionResult& result)
 {
+    if (sender() != gradFuseWorker)
+        return;
+    gradFuseWorker = nullptr;
     textEditSetText(
         ui.textEditGradFuseRslts, result.msg,
         Qt::GlobalColor::black, false
@@ -765,6 +945,14 @@ void InteractiveDigitalMontage::adjustSpinBoxOnSmoothTypeChanged()
     }
 }
 
+MontageCore::LabelMatchSettings InteractiveDigitalMontage::labelMatchSettings() const
+{
+    MontageCore::LabelMatchSettings settings;
+    settings.MemoryBudget = ui.doubleSpinBoxMemoryBudget->value() * (1 << 30);
+    settings.InertiaWeight = ui.doubleSpinBoxInertiaWeight->value();
+    return settings;
+}
+
 InteractiveDigitalMontage::InteractiveDigitalMontage(QWidget *parent)
     : QMainWindow(parent)
 {
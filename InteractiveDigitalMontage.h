@@ -6,6 +6,7 @@
 #include <QGraphicsScene>
 #include <QVector>
 #include <QImage>
+#include <QPointer>
 
 #include "ui_InteractiveDigitalMontage.h"
 
@@ -31,6 +32,9 @@ private:
     QVector<QColor> srcImgLblCols;
     QVector<QImage> designatedLbls;
     int imgW = 0, imgH = 0;
+    // srcImgs downsampled by previewScale once on load, for previews
+    QVector<QImage> previewImgs;
+    int previewScale = 1;
     
     int currSrcIdx = -1;
     void changeCurrSrcIdxTo(int newIdx); 
@@ -45,6 +49,35 @@ private:
     QImage LMRslts[LMRsltNum];
 
     QImage GFRslt;
+    void loadLblMatchRslts(const MontageLabelMatchResult& result);
+
+    // the running workers, results of other workers are dropped
+    QPointer<MontageLabelMatchWorker> lblMatchWorker;
+    QPointer<MontageGradientFusionWorker> gradFuseWorker;
+    QPointer<MontagePreviewWorker> previewWorker;
+    // strokes changed while previewWorker was running
+    bool previewPending = false;
+    // cancelled workers that have not returned yet
+    QVector<QThread*> retiringWorkers;
+    // the worker started once retiringWorkers are all finished
+    QPointer<QThread> pendingWorker;
+    QThread::Priority pendingPriority = QThread::InheritPriority;
+    // Usage:
+    //   Cancel the running workers without waiting for them,
+    //   they are retired until their finished signal arrives
+    void cancelRunningWorkers();
+    void retireWorker(QThread* worker);
+    // Usage:
+    //   Start <worker> once no cancelled worker is running,
+    //   since MontageCore keeps its buffers in static memory
+    void startWorker(QThread* worker, QThread::Priority priority);
+    void handleWorkerFinished();
+    // Usage:
+    //   Preview Label Match of current strokes in the background,
+    //   bursts of edits are coalesced into one preview of the latest strokes
+    void requestPreview();
+    void handlePreviewRslt(const MontageLabelMatchResult& result);
+    void handlePreviewFinished();
 public:
     void goToPreviousImage();
     void goToNextImage();
@@ -60,6 +93,7 @@ public:
     void updateStrokeWidth();
 
     void runLabelMatching();
+    void handleLblMatchProgress(const MontageLabelMatchResult& result);
     void handleLblMatchRslt(const MontageLabelMatchResult& result);
     void switchLblMatchRslts();
     void exportLblMatchRslt();
@@ -69,6 +103,10 @@ public:
     void exportGradFuseRslt();
 
     void adjustSpinBoxOnSmoothTypeChanged();
+private:
+    // Usage:
+    //   Tuning of Label Match and preview chosen in the UI
+    MontageCore::LabelMatchSettings labelMatchSettings() const;
 public:
     InteractiveDigitalMontage(QWidget *parent = Q_NULLPTR);
 private:
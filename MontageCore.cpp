@@ -5,6 +5,10 @@
 #include "SparseMat.h"
 
 #include <sstream>
+#include <array>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 using namespace cv;
 
@@ -13,308 +17,2206 @@ static double smooth_alpha = 100.0; // can be modified by user
 // can be chosen by user
 static MontageCore::SmoothTermType smooth_type = MontageCore::SmoothTermType::X;
 // can be chosen by user
+static MontageCore::LabelMatchMode label_match_mode = MontageCore::LabelMatchMode::Full_Resolution;
+// can be chosen by user
+static MontageCore::GraphPrecision graph_precision = MontageCore::GraphPrecision::Double;
+// tuning of the running Label Match, see MontageCore::LabelMatchSettings
+static double label_match_memory_budget = 2.0 * (1 << 30);
+// Anytime Label Match: optimization stops after the first cycle (or tiling pass, block round)
+// that ends label_match_time_budget seconds after the start of the run, or that lowers
+// the energy by less than label_match_min_improvement of it; 0 disables either test
+static double label_match_time_budget = 0.0; // can be chosen by user
+static double label_match_min_improvement = 0.0; // can be chosen by user
+static int64 label_match_start_ticks = 0;
+// cancel flag bound to the running Label Match, may be null
+static const std::atomic<bool>* label_match_cancel = nullptr;
+static double preview_max_pixels = 160 * 160;
+static double preview_time_budget = 0.1;
+// can be chosen by user
 static MontageCore::GradientFusionSolverType solver_type = MontageCore::GradientFusionSolverType::Eigen_Solver;
 
 // buffered images
 // generated from last Label Match
 // to be used in successive Gradient Fusion
 static std::vector<cv::Mat> BufImages;
+// buffered coverage masks, empty if sources covered everything
+static std::vector<cv::Mat> BufCoverage;
 // buffered result label
 static cv::Mat BufResultLabel;
+// buffered strokes of last Label Match,
+// empty if it can not be used as a warm start
+static cv::Mat BufLabel;
+// graphs of finished moves, taken by later moves of the same and of later Label Matches
+// instead of allocating new ones, while canvas size and Label Match mode stay the same
+static GCoptimization::GraphPool label_match_graphs;
+// pool the running solve takes its graphs from, label_match_graphs but for a preview
+static GCoptimization::GraphPool* label_match_pool = &label_match_graphs;
+static cv::Size label_match_graphs_size;
+static MontageCore::LabelMatchMode label_match_graphs_mode = MontageCore::LabelMatchMode::Full_Resolution;
+// more tuning of the running Label Match, see MontageCore::LabelMatchSettings
+static bool grid_maxflow = false;
+static int parallel_maxflow_min_threads = 8;
+static int incremental_radius = 24;
+static int agreement_tolerance = 0;
+static double inertia_weight = 0.0;
+
+static MontageCore::LabelMatchSettings label_match_settings()
+{
+	MontageCore::LabelMatchSettings settings;
+	settings.MemoryBudget = label_match_memory_budget;
+	settings.IncrementalRadius = incremental_radius;
+	settings.AgreementTolerance = agreement_tolerance;
+	settings.InertiaWeight = inertia_weight;
+	settings.PreviewMaxPixels = preview_max_pixels;
+	settings.PreviewTimeBudget = preview_time_budget;
+	settings.GridMaxflow = grid_maxflow;
+	settings.ParallelMaxflowMinThreads = parallel_maxflow_min_threads;
+	return settings;
+}
+
+static void set_label_match_settings(const MontageCore::LabelMatchSettings& Settings)
+{
+	label_match_memory_budget = Settings.MemoryBudget;
+	incremental_radius = Settings.IncrementalRadius;
+	agreement_tolerance = Settings.AgreementTolerance;
+	inertia_weight = Settings.InertiaWeight;
+	preview_max_pixels = Settings.PreviewMaxPixels;
+	preview_time_budget = Settings.PreviewTimeBudget;
+	grid_maxflow = Settings.GridMaxflow;
+	parallel_maxflow_min_threads = Settings.ParallelMaxflowMinThreads;
+}
+
+// Stops a cancelled Label Match the same way gco stops an interrupted move.
+static void check_label_match_cancel()
+{
+	if (label_match_cancel != nullptr && label_match_cancel->load())
+		throw GCException("Interrupted.");
+}
+
+// Data costs only depend on user strokes:
+// a stroked pixel costs 0 for its designated label and large_penalty otherwise,
+// an unstroked pixel costs the same for every label, which is left as 0.
+// So only stroked pixels are registered as sparse costs.
+static void set_stroke_data_costs(GCoptimization* gc, const cv::Mat& Label, int n_label)
+{
+	int width = Label.cols;
+	int height = Label.rows;
+
+	std::vector<GCoptimization::SiteID> stroked;
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			if (Label.at<short>(y, x) != MontageCore::undefined)
+				stroked.push_back(y * width + x);
+
+	std::vector<GCoptimization::SparseDataCost> costs(stroked.size());
+	for (int l = 0; l < n_label; l++)
+	{
+		for (size_t i = 0; i < stroked.size(); i++)
+		{
+			GCoptimization::SiteID p = stroked[i];
+			costs[i].site = p;
+			costs[i].cost = Label.at<short>(p / width, p % width) == l ? 0.0 : large_penalty;
+		}
+		gc->setDataCost(l, costs.data(), stroked.size());
+	}
+	gc->setSparseDataCostDefault(0.0);
+}
+
+// Inertia planes of Label Match, one CV_16UC1 plane per source holding the
+// distance (in pixels, rounded) from each pixel to the nearest stroke of that source.
+// On a level downsampled by Scale, distances are still in full resolution pixels,
+// so that inertia_weight costs the same on every level.
+// Sources without strokes are as far as the canvas diagonal everywhere,
+// they all share one plane.
+// Each plane is one linear-time distance transform; empty if inertia_weight is 0.
+static std::vector<cv::Mat> inertia_planes(const cv::Mat& Label, int n_label, int Scale = 1)
+{
+	std::vector<Mat> planes;
+	if (inertia_weight <= 0)
+		return planes;
+
+	planes.resize(n_label);
+	double diagonal = Scale * std::sqrt((double)Label.cols * Label.cols + (double)Label.rows * Label.rows);
+	Mat far, dist;
+	for (int l = 0; l < n_label; l++)
+	{
+		check_label_match_cancel();
+		Mat not_stroked = Label != l;
+		if (cv::countNonZero(not_stroked) == (int)Label.total())
+		{
+			if (far.empty())
+				far = Mat(Label.size(), CV_16UC1, Scalar(cv::saturate_cast<ushort>(diagonal)));
+			planes[l] = far;
+			continue;
+		}
+		cv::distanceTransform(not_stroked, dist, DIST_L2, DIST_MASK_5);
+		dist.convertTo(planes[l], CV_16UC1, Scale);
+	}
+	return planes;
+}
+
+// Windows of Planes, sharing their data.
+static std::vector<cv::Mat> planes_in(const std::vector<cv::Mat>& Planes, const cv::Rect& Window)
+{
+	std::vector<Mat> windows(Planes.size());
+	for (size_t i = 0; i < Planes.size(); i++)
+		windows[i] = Planes[i](Window);
+	return windows;
+}
+
+// Sources that Label strokes or InitLabel (CV_16UC1, may be empty) uses, in order.
+// gco needs 2 labels, so the first unused sources are added if there are fewer.
+static std::vector<int> active_labels(const cv::Mat& Label, const cv::Mat& InitLabel, int n_label)
+{
+	std::vector<uchar> used(n_label, 0);
+	for (int y = 0; y < Label.rows; y++)
+		for (int x = 0; x < Label.cols; x++)
+		{
+			short stroke = Label.at<short>(y, x);
+			if (stroke != MontageCore::undefined)
+				used[stroke] = 1;
+			if (!InitLabel.empty())
+				used[InitLabel.at<ushort>(y, x)] = 1;
+		}
+	int n_used = std::count(used.begin(), used.end(), 1);
+	for (int l = 0; l < n_label && n_used < 2; l++)
+		if (!used[l])
+		{
+			used[l] = 1;
+			n_used++;
+		}
+
+	std::vector<int> active;
+	for (int l = 0; l < n_label; l++)
+		if (used[l])
+			active.push_back(l);
+	return active;
+}
+
+// Labels (CV_16SC1 strokes or CV_16UC1 labeling) with every label l mapped to Map[l],
+// undefined strokes stay undefined.
+static cv::Mat remap_labels(const cv::Mat& Labels, const std::vector<int>& Map)
+{
+	Mat mapped(Labels.size(), Labels.type());
+	for (int y = 0; y < Labels.rows; y++)
+		for (int x = 0; x < Labels.cols; x++)
+			if (Labels.depth() == CV_16S)
+			{
+				short l = Labels.at<short>(y, x);
+				mapped.at<short>(y, x) = l == MontageCore::undefined ? l : Map[l];
+			}
+			else
+				mapped.at<ushort>(y, x) = Map[Labels.at<ushort>(y, x)];
+	return mapped;
+}
 
-Mat _data;
+// Frees the pooled graphs of label_match_graphs if they were grown
+// for another canvas size or Label Match mode.
+static void keep_label_match_graphs_for(cv::Size CanvasSize)
+{
+	if (CanvasSize != label_match_graphs_size || label_match_mode != label_match_graphs_mode)
+		label_match_graphs.clear();
+	label_match_graphs_size = CanvasSize;
+	label_match_graphs_mode = label_match_mode;
+}
+
+// Coverage masks of Label Match, one CV_8UC1 mask per source (non-zero where the
+// source has content), or empty if no source has a mask.
+// Sources without a mask among others cover the whole canvas.
+static std::vector<cv::Mat> coverage_masks(const std::vector<cv::Mat>& Coverage, int n_label)
+{
+	cv::Size size;
+	for (const Mat& mask : Coverage)
+		if (!mask.empty())
+			size = mask.size();
+	std::vector<Mat> masks;
+	if (size.area() == 0)
+		return masks;
+
+	masks.resize(n_label);
+	for (int l = 0; l < n_label; l++)
+		if (l < (int)Coverage.size() && !Coverage[l].empty())
+			masks[l] = Coverage[l];
+		else
+			masks[l] = Mat(size, CV_8UC1, Scalar(255));
+	return masks;
+}
+
+// Pixels covered by at least one of the Coverage masks.
+static cv::Mat covered_by_any(const std::vector<cv::Mat>& Coverage)
+{
+	Mat any = Coverage[0] != 0;
+	for (size_t l = 1; l < Coverage.size(); l++)
+		any |= Coverage[l] != 0;
+	return any;
+}
+
+// With coverage, pixels that none of the Active sources covers need a source that does,
+// the first ones covering them are added to Active.
+static void add_covering_labels(std::vector<int>& Active, const std::vector<cv::Mat>& Coverage)
+{
+	Mat covered = Mat::zeros(Coverage[0].size(), CV_8UC1);
+	for (int l : Active)
+		covered |= Coverage[l] != 0;
+	for (int l = 0; l < (int)Coverage.size(); l++)
+	{
+		if (std::find(Active.begin(), Active.end(), l) != Active.end()
+			|| cv::countNonZero((Coverage[l] != 0) & (covered == 0)) == 0)
+			continue;
+		Active.push_back(l);
+		covered |= Coverage[l] != 0;
+	}
+	std::sort(Active.begin(), Active.end());
+}
+
+// Data costs with coverage: a source is infeasible outside its mask, unless it is
+// stroked there or no source covers the pixel. Feasible pixels cost as in
+// set_stroke_data_costs, or as in InertiaDataCost if Inertia is given.
+// Only feasible pixels are listed, so an expansion of a source only visits its coverage.
+static void set_coverage_data_costs(GCoptimization* gc, const cv::Mat& Label,
+	const std::vector<cv::Mat>& Inertia, const std::vector<cv::Mat>& Coverage)
+{
+	int width = Label.cols;
+	int height = Label.rows;
+	Mat any = covered_by_any(Coverage);
+
+	std::vector<GCoptimization::SparseDataCost> costs;
+	for (int l = 0; l < (int)Coverage.size(); l++)
+	{
+		costs.clear();
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+			{
+				short stroke = Label.at<short>(y, x);
+				if (!Coverage[l].at<uchar>(y, x) && any.at<uchar>(y, x) && stroke != l)
+					continue;
+				GCoptimization::SparseDataCost cost;
+				cost.site = y * width + x;
+				if (stroke != MontageCore::undefined)
+					cost.cost = stroke == l ? 0.0 : large_penalty;
+				else
+					cost.cost = Inertia.empty() ? 0.0 : inertia_weight * Inertia[l].at<ushort>(y, x);
+				costs.push_back(cost);
+			}
+		gc->setDataCost(l, costs.data(), costs.size());
+	}
+	gc->setSparseDataCostDefault(GCO_MAX_ENERGYTERM);
+}
+
+// Labeling that is feasible under Coverage: InitLabel (may be empty) where it is,
+// elsewhere the stroked label or the first source covering the pixel.
+static cv::Mat feasible_labeling(const cv::Mat& Label, const cv::Mat& InitLabel,
+	const std::vector<cv::Mat>& Coverage)
+{
+	Mat labeling = InitLabel.empty() ? Mat::zeros(Label.size(), CV_16UC1) : InitLabel.clone();
+	for (int y = 0; y < Label.rows; y++)
+		for (int x = 0; x < Label.cols; x++)
+		{
+			short stroke = Label.at<short>(y, x);
+			ushort& l = labeling.at<ushort>(y, x);
+			if (stroke != MontageCore::undefined)
+			{
+				if (InitLabel.empty() || !Coverage[l].at<uchar>(y, x))
+					l = stroke;
+				continue;
+			}
+			if (!InitLabel.empty() && Coverage[l].at<uchar>(y, x))
+				continue;
+			for (int c = 0; c < (int)Coverage.size(); c++)
+				if (Coverage[c].at<uchar>(y, x))
+				{
+					l = c;
+					break;
+				}
+		}
+	return labeling;
+}
+
+// Data costs with inertia: a stroked pixel costs as in set_stroke_data_costs,
+// an unstroked pixel costs inertia_weight times its distance to the nearest
+// stroke of the label, read from the inertia planes.
+class InertiaDataCost : public GCoptimization::DataCostFunctor
+{
+public:
+	InertiaDataCost(const cv::Mat& Label, const std::vector<cv::Mat>& Planes)
+		: Label(Label), Planes(Planes)
+	{
+	}
+	GCoptimization::EnergyTermType compute(
+		GCoptimization::SiteID s, GCoptimization::LabelID l) override
+	{
+		int y = s / Label.cols;
+		int x = s % Label.cols;
+		short stroke = Label.at<short>(y, x);
+		if (stroke != MontageCore::undefined)
+			return stroke == l ? 0.0 : large_penalty;
+		return inertia_weight * Planes[l].at<ushort>(y, x);
+	}
+	bool threadSafe() const override
+	{
+		return true;
+	}
+private:
+	const cv::Mat& Label;
+	const std::vector<cv::Mat>& Planes;
+};
+
+// Label stack of one Label Match.
+// For each pixel, all sources are stored next to each other (site-major),
+// and each source takes 3 x 4 int16:
+//   [ B G R 0 | dB/dx dG/dx dR/dx 0 | dB/dy dG/dy dR/dy 0 ]
+// Gradients are signed Sobel responses, channels are padded to 4 for SIMD loads.
+// When built with a mask, only masked pixels are stored and Index maps
+// each pixel to its row (-1 if not stored).
+struct LabelStack
+{
+	static const int cColor = 0;
+	static const int cXGrad = 4;
+	static const int cYGrad = 8;
+	static const int cStride = 12; // int16 per (pixel, label)
+
+	int width = 0;
+	int height = 0;
+	int n_label = 0;
+	size_t n_row = 0;
+	std::vector<int> Index; // empty if every pixel is stored
+	std::vector<short> Data;
+
+	void Build(const std::vector<cv::Mat>& Images, const cv::Mat& Mask = cv::Mat());
+	int Row(size_t site) const
+	{
+		return Index.empty() ? (int)site : Index[site];
+	}
+	const short* At(int row, int label) const
+	{
+		return &Data[((size_t)row * n_label + label) * cStride];
+	}
+};
+
+void LabelStack::Build(const std::vector<cv::Mat>& Images, const cv::Mat& Mask)
+{
+	width = Images[0].cols;
+	height = Images[0].rows;
+	n_label = Images.size();
+
+	Index.clear();
+	n_row = (size_t)width * height;
+	if (!Mask.empty())
+	{
+		Index.assign((size_t)width * height, -1);
+		n_row = 0;
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				if (Mask.at<uchar>(y, x))
+					Index[(size_t)y * width + x] = n_row++;
+	}
+	Data.assign(n_row * n_label * cStride, 0);
+
+	Mat color, x_grad, y_grad;
+	for (int l = 0; l < n_label; l++)
+	{
+		check_label_match_cancel();
+		Images[l].convertTo(color, CV_16SC3);
+		cv::Sobel(Images[l], x_grad, CV_16S, 1, 0);
+		cv::Sobel(Images[l], y_grad, CV_16S, 0, 1);
+
+#pragma omp parallel for schedule(static)
+		for (int y = 0; y < height; y++)
+		{
+			const Vec3s* c_row = color.ptr<Vec3s>(y);
+			const Vec3s* x_row = x_grad.ptr<Vec3s>(y);
+			const Vec3s* y_row = y_grad.ptr<Vec3s>(y);
+			for (int x = 0; x < width; x++)
+			{
+				int row = Row((size_t)y * width + x);
+				if (row < 0)
+					continue;
+				short* v = &Data[((size_t)row * n_label + l) * cStride];
+				for (int c = 0; c < 3; c++)
+				{
+					v[cColor + c] = c_row[x][c];
+					v[cXGrad + c] = x_row[x][c];
+					v[cYGrad + c] = y_row[x][c];
+				}
+			}
+		}
+	}
+}
+
+static float euc_dist(const short* a, const short* b)
+{
+	float d0 = a[0] - b[0];
+	float d1 = a[1] - b[1];
+	float d2 = a[2] - b[2];
+	return sqrt(d0 * d0 + d1 * d1 + d2 * d2);
+}
+
+static float edge_potential(const short* grad)
+{
+	float r = grad[0], g = grad[1], b = grad[2];
+	return sqrt(r * r + g * g + b * b);
+}
+
+// Bytes per pixel of the seam cost tables of n_label sources, or 0 if they are not built
+// whatever the budget: their n_label * (n_label - 1) / 2 pair costs per pixel outgrow
+// the label stack they are computed from beyond 13 sources (9 with X_Divide_By_Z).
+static double seam_table_bytes_per_pixel(int n_label)
+{
+	const bool z_term = smooth_type == MontageCore::SmoothTermType::X_Divide_By_Z;
+	double table = ((double)n_label * (n_label - 1) / 2 + (z_term ? 2 * n_label : 0)) * sizeof(float);
+	double stack = (double)n_label * LabelStack::cStride * sizeof(short);
+	return table <= stack ? table : 0;
+}
+
+// Seam costs of one Label Match, computed once before optimization.
+// Every smooth term is separable into a per-pixel part:
+//   X_term(p,q,lp,lq) = alpha * (|I_lp(p) - I_lq(p)| + |I_lp(q) - I_lq(q)|)
+// so PairCosts stores, for each pixel, one float per unordered label pair
+// and gco only needs two table reads per neighbour pair.
+// For X_Divide_By_Z, EdgeCosts additionally keeps the per-label edge
+// potential of the right (horizontal) and lower (vertical) edge of a pixel.
+// Tables follow the rows of the LabelStack they are built from; an edge with
+// an endpoint outside a masked stack joins two fixed pixels and costs 0 here.
+// If the tables would not fit in the given budget, or would be larger than the stack
+// (see seam_table_bytes_per_pixel), the stack is kept instead and every query
+// computes its per-pixel parts from it.
+class SeamCostTable : public GCoptimization::SmoothCostFunctor
+{
+public:
+	void Build(LabelStack&& Stack, double TableBudget);
+	GCoptimization::EnergyTermType compute(
+		GCoptimization::SiteID s1, GCoptimization::SiteID s2,
+		GCoptimization::LabelID l1, GCoptimization::LabelID l2) override;
+	void computeBatch(GCoptimization::SiteID count,
+		const GCoptimization::SiteID* s1, const GCoptimization::SiteID* s2,
+		const GCoptimization::LabelID* l1, const GCoptimization::LabelID* l2,
+		GCoptimization::EnergyTermType* costs) override;
+	// largest seam cost gco can query, leaving out X_Divide_By_Z terms clamped to large_penalty
+	double MaxTerm();
+private:
+	void BuildPairCosts(const LabelStack& Stack, int row);
+	void BuildEdgeCosts(const LabelStack& Stack, int row);
+	float PairCost(int row, int lp, int lq) const;
+	float EdgeCost(int row, int dir, int l) const;
+	int Row(GCoptimization::SiteID site) const
+	{
+		return Index.empty() ? site : Index[site];
+	}
+
+	double MaxXTerm() const;
+
+	int width = 0;
+	int n_site = 0;
+	int n_label = 0;
+	int n_pair = 0;
+	bool tabled = false;
+	std::vector<int> Index; // same as LabelStack::Index
+	std::vector<int> PairIdx; // n_label * n_label -> index of unordered pair
+	std::vector<float> PairCosts; // n_pixel * n_pair
+	std::vector<float> EdgeCosts; // n_pixel * 2 * n_label
+	LabelStack Stack; // only kept if the tables are not built
+};
+
+// per-pixel part of X_term between two sources
+static float pair_cost(const short* vlp, const short* vlq)
+{
+	float cost = smooth_alpha * euc_dist(vlp + LabelStack::cColor, vlq + LabelStack::cColor);
+	if (smooth_type == MontageCore::SmoothTermType::X_Plus_Y)
+	{
+		cost += euc_dist(vlp + LabelStack::cYGrad, vlq + LabelStack::cYGrad);
+		cost += euc_dist(vlp + LabelStack::cXGrad, vlq + LabelStack::cXGrad);
+	}
+	return cost;
+}
+
+void SeamCostTable::Build(LabelStack&& Stack, double TableBudget)
+{
+	width = Stack.width;
+	n_site = Stack.width * Stack.height;
+	n_label = Stack.n_label;
+	n_pair = n_label * (n_label - 1) / 2;
+	Index = Stack.Index;
+
+	PairIdx.assign(n_label * n_label, -1);
+	int k = 0;
+	for (int lp = 0; lp < n_label; lp++)
+		for (int lq = lp + 1; lq < n_label; lq++)
+		{
+			PairIdx[lp * n_label + lq] = k;
+			PairIdx[lq * n_label + lp] = k;
+			k++;
+		}
+
+	const int n_row = (int)Stack.n_row;
+	const bool z_term = smooth_type == MontageCore::SmoothTermType::X_Divide_By_Z;
+	double table_bytes = n_row * seam_table_bytes_per_pixel(n_label);
+	tabled = table_bytes > 0 && table_bytes <= TableBudget;
+	PairCosts.clear();
+	EdgeCosts.clear();
+	this->Stack = LabelStack();
+	if (!tabled)
+	{
+		this->Stack = std::move(Stack);
+		return;
+	}
+
+	// built in chunks of rows, so that a cancelled Label Match stops in between
+	const int cChunkRows = 1 << 16;
+	PairCosts.resize((size_t)n_row * n_pair);
+	for (int begin = 0; begin < n_row; begin += cChunkRows)
+	{
+		check_label_match_cancel();
+		const int end = std::min(n_row, begin + cChunkRows);
+#pragma omp parallel for schedule(static)
+		for (int row = begin; row < end; row++)
+			BuildPairCosts(Stack, row);
+	}
+
+	if (!z_term)
+		return;
+
+	EdgeCosts.resize((size_t)n_row * 2 * n_label);
+	for (int begin = 0; begin < n_row; begin += cChunkRows)
+	{
+		check_label_match_cancel();
+		const int end = std::min(n_row, begin + cChunkRows);
+#pragma omp parallel for schedule(static)
+		for (int row = begin; row < end; row++)
+			BuildEdgeCosts(Stack, row);
+	}
+}
+
+void SeamCostTable::BuildPairCosts(const LabelStack& Stack, int row)
+{
+	float* costs = &PairCosts[(size_t)row * n_pair];
+	for (int lp = 0; lp < n_label; lp++)
+		for (int lq = lp + 1; lq < n_label; lq++)
+			costs[PairIdx[lp * n_label + lq]] = pair_cost(Stack.At(row, lp), Stack.At(row, lq));
+}
+
+void SeamCostTable::BuildEdgeCosts(const LabelStack& Stack, int row)
+{
+	float* costs = &EdgeCosts[(size_t)row * 2 * n_label];
+	for (int l = 0; l < n_label; l++)
+	{
+		const short* v = Stack.At(row, l);
+		// horizontal neighbors are on an edge if vertical grad is large,
+		// vertical neighbors if horizonal grad is large
+		costs[l] = edge_potential(v + LabelStack::cYGrad);
+		costs[n_label + l] = edge_potential(v + LabelStack::cXGrad);
+	}
+}
+
+float SeamCostTable::PairCost(int row, int lp, int lq) const
+{
+	if (tabled)
+		return PairCosts[(size_t)row * n_pair + PairIdx[lp * n_label + lq]];
+	return pair_cost(Stack.At(row, lp), Stack.At(row, lq));
+}
+
+// dir is 0 for the right edge of the pixel, 1 for its lower edge
+float SeamCostTable::EdgeCost(int row, int dir, int l) const
+{
+	if (tabled)
+		return EdgeCosts[((size_t)row * 2 + dir) * n_label + l];
+	return edge_potential(Stack.At(row, l) + (dir == 0 ? LabelStack::cYGrad : LabelStack::cXGrad));
+}
+
+double SeamCostTable::MaxXTerm() const
+{
+	float max_cost = 0.0f;
+	if (tabled)
+	{
+		for (float cost : PairCosts)
+			max_cost = std::max(max_cost, cost);
+		return 2.0 * max_cost;
+	}
+
+	std::vector<float> row_max(Stack.n_row, 0.0f);
+#pragma omp parallel for schedule(static)
+	for (int row = 0; row < (int)Stack.n_row; row++)
+		for (int lp = 0; lp < n_label; lp++)
+			for (int lq = lp + 1; lq < n_label; lq++)
+				row_max[row] = std::max(row_max[row], PairCost(row, lp, lq));
+	for (float cost : row_max)
+		max_cost = std::max(max_cost, cost);
+	return 2.0 * max_cost;
+}
+
+double SeamCostTable::MaxTerm()
+{
+	if (smooth_type != MontageCore::SmoothTermType::X_Divide_By_Z)
+		return MaxXTerm();
+
+	// Z terms are far smaller than X terms, so they are scanned over every edge
+	int height = n_site / width;
+	std::vector<double> line_max(height, 0.0);
+#pragma omp parallel for schedule(static)
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+		{
+			int s = y * width + x;
+			for (int dir = 0; dir < 2; dir++)
+			{
+				if (dir == 0 ? x + 1 == width : y + 1 == height)
+					continue;
+				int q = dir == 0 ? s + 1 : s + width;
+				if (Row(s) < 0 || Row(q) < 0)
+					continue;
+				for (int lp = 0; lp < n_label; lp++)
+					for (int lq = lp + 1; lq < n_label; lq++)
+					{
+						double cost = compute(s, q, lp, lq);
+						if (cost < large_penalty)
+							line_max[y] = std::max(line_max[y], cost);
+					}
+			}
+		}
+	double max_cost = 0.0;
+	for (double cost : line_max)
+		max_cost = std::max(max_cost, cost);
+	return max_cost;
+}
+
+GCoptimization::EnergyTermType SeamCostTable::compute(
+	GCoptimization::SiteID s1, GCoptimization::SiteID s2,
+	GCoptimization::LabelID l1, GCoptimization::LabelID l2)
+{
+	if (l1 == l2)
+		return 0.0;
+	int r1 = Row(s1), r2 = Row(s2);
+	if (r1 < 0 || r2 < 0)
+		return 0.0;
+
+	double X_term = PairCost(r1, l1, l2) + PairCost(r2, l1, l2);
+	if (smooth_type != MontageCore::SmoothTermType::X_Divide_By_Z)
+		return X_term;
+
+	// the edge between p and q is stored at the smaller site of them,
+	// q is below p if they are a row apart (also on a canvas one pixel wide)
+	int e = s1 < s2 ? r1 : r2;
+	int dir = (s1 - s2 == width || s2 - s1 == width) ? 1 : 0;
+	double Z_term = X_term / (EdgeCost(e, dir, l1) + EdgeCost(e, dir, l2));
+
+	if (Z_term > large_penalty || Z_term != Z_term)
+		return large_penalty;
+	return Z_term;
+}
+
+// Evaluates the same costs as compute(), 4 neighbor pairs per AVX2 pass:
+// pair indices and table entries are gathered, summed in float as compute()
+// does, then widened to double for gco.
+void SeamCostTable::computeBatch(GCoptimization::SiteID count,
+	const GCoptimization::SiteID* s1, const GCoptimization::SiteID* s2,
+	const GCoptimization::LabelID* l1, const GCoptimization::LabelID* l2,
+	GCoptimization::EnergyTermType* costs)
+{
+	GCoptimization::SiteID k = 0;
+#if defined(__AVX2__)
+	const bool z_term = smooth_type == MontageCore::SmoothTermType::X_Divide_By_Z;
+	const __m128i v_n_label = _mm_set1_epi32(n_label);
+	const __m256i v_n_pair = _mm256_set1_epi64x(n_pair);
+	const __m256i v_n_label64 = _mm256_set1_epi64x(n_label);
+	const __m128i v_width = _mm_set1_epi32(width);
+	const __m128i v_one = _mm_set1_epi32(1);
+	const __m256d v_large_penalty = _mm256_set1_pd(large_penalty);
+	// without tables every query reads the stack, which compute() does
+	for (; tabled && k + 4 <= count; k += 4)
+	{
+		__m128i vs1 = _mm_loadu_si128((const __m128i*)(s1 + k));
+		__m128i vs2 = _mm_loadu_si128((const __m128i*)(s2 + k));
+		__m128i vl1 = _mm_loadu_si128((const __m128i*)(l1 + k));
+		__m128i vl2 = _mm_loadu_si128((const __m128i*)(l2 + k));
+		__m128i vr1 = vs1, vr2 = vs2;
+		if (!Index.empty())
+		{
+			vr1 = _mm_i32gather_epi32(Index.data(), vs1, 4);
+			vr2 = _mm_i32gather_epi32(Index.data(), vs2, 4);
+		}
+		// l1 == l2 lanes and lanes outside the table cost 0,
+		// their (invalid) pair index and rows are clamped to 0
+		__m128i zero = _mm_or_si128(_mm_cmpeq_epi32(vl1, vl2),
+			_mm_cmplt_epi32(_mm_min_epi32(vr1, vr2), _mm_setzero_si128()));
+		vr1 = _mm_max_epi32(vr1, _mm_setzero_si128());
+		vr2 = _mm_max_epi32(vr2, _mm_setzero_si128());
+		__m128i pair = _mm_i32gather_epi32(PairIdx.data(),
+			_mm_add_epi32(_mm_mullo_epi32(vl1, v_n_label), vl2), 4);
+		__m256i pair64 = _mm256_cvtepi32_epi64(_mm_max_epi32(pair, _mm_setzero_si128()));
+
+		__m256i idx1 = _mm256_add_epi64(_mm256_mul_epi32(_mm256_cvtepi32_epi64(vr1), v_n_pair), pair64);
+		__m256i idx2 = _mm256_add_epi64(_mm256_mul_epi32(_mm256_cvtepi32_epi64(vr2), v_n_pair), pair64);
+		__m128 x_term = _mm_add_ps(
+			_mm256_i64gather_ps(PairCosts.data(), idx1, 4),
+			_mm256_i64gather_ps(PairCosts.data(), idx2, 4));
+		__m256d result = _mm256_cvtps_pd(x_term);
+
+		if (z_term)
+		{
+			// the edge between p and q is stored at the smaller site of them
+			__m128i e = _mm_blendv_epi8(vr2, vr1, _mm_cmplt_epi32(vs1, vs2));
+			__m128i vertical = _mm_cmpeq_epi32(_mm_abs_epi32(_mm_sub_epi32(vs1, vs2)), v_width);
+			__m128i dir = _mm_and_si128(vertical, v_one);
+			__m256i base = _mm256_mul_epi32(
+				_mm256_cvtepi32_epi64(_mm_add_epi32(_mm_add_epi32(e, e), dir)), v_n_label64);
+			__m128 potential = _mm_add_ps(
+				_mm256_i64gather_ps(EdgeCosts.data(), _mm256_add_epi64(base, _mm256_cvtepi32_epi64(vl1)), 4),
+				_mm256_i64gather_ps(EdgeCosts.data(), _mm256_add_epi64(base, _mm256_cvtepi32_epi64(vl2)), 4));
+			__m256d z = _mm256_div_pd(result, _mm256_cvtps_pd(potential));
+			// NaN compares false as well, so it also falls back to large_penalty
+			__m256d keep = _mm256_cmp_pd(z, v_large_penalty, _CMP_LE_OQ);
+			result = _mm256_blendv_pd(v_large_penalty, z, keep);
+		}
+
+		__m256d zero_mask = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(zero));
+		result = _mm256_andnot_pd(zero_mask, result);
+		_mm256_storeu_pd(costs + k, result);
+	}
+#endif
+	for (; k < count; k++)
+		costs[k] = compute(s1[k], s2[k], l1[k], l2[k]);
+}
+
+// used to return message to GUI
+void TryAppendResultMsg(std::string* msg, const std::string& str)
+{
+	if (msg == nullptr)return;
+	msg->append(str + "\n");
+}
+
+// used to return image or label to GUI
+static void TrySetResultMat(cv::Mat* mat, const cv::Mat& right)
+{
+	if (mat == nullptr)return;
+	(*mat) = right;
+}
+
+void MontageCore::RunLabelMatch(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
+	double LargePenalty, double SmoothAlpha, SmoothTermType SmoothType, LabelMatchMode Mode,
+	GraphPrecision Precision, double TimeBudget, double MinImprovement,
+	const std::vector<cv::Mat>& Coverage)
+{
+	// last result is only a warm start for the same energy
+	if (large_penalty != LargePenalty || smooth_alpha != SmoothAlpha
+		|| smooth_type != SmoothType || label_match_mode != Mode
+		|| graph_precision != Precision
+		|| agreement_tolerance != Settings.AgreementTolerance
+		|| inertia_weight != Settings.InertiaWeight)
+		BufLabel.release();
+	set_label_match_settings(Settings);
+	large_penalty = LargePenalty;
+	smooth_alpha = SmoothAlpha;
+	smooth_type = SmoothType;
+	label_match_mode = Mode;
+	graph_precision = Precision;
+	label_match_time_budget = TimeBudget;
+	label_match_min_improvement = MinImprovement;
+	label_match_start_ticks = cv::getTickCount();
+	label_match_cancel = Cancel;
+	BuildSolveMRF(Images, Label, Coverage);
+	label_match_cancel = nullptr;
+}
+
+// Preview Label Match:
+// solves the heavily downsampled copy of the stack it is given and shows its labeling and composite.
+// It solves with double precision on the generic serial maxflow, whatever last Label Match used,
+// and takes its graphs from a pool of its own. The settings, buffers and pooled graphs
+// of last Label Match are restored or left untouched, so a later Label Match still
+// warm starts from its own result.
+void MontageCore::RunPreviewMatch(const std::vector<cv::Mat>& Images, const cv::Mat& Label, int Scale,
+	double LargePenalty, double SmoothAlpha, SmoothTermType SmoothType,
+	const std::vector<cv::Mat>& Coverage)
+{
+	double last_large_penalty = large_penalty;
+	double last_smooth_alpha = smooth_alpha;
+	SmoothTermType last_smooth_type = smooth_type;
+	double last_time_budget = label_match_time_budget;
+	double last_min_improvement = label_match_min_improvement;
+	GraphPrecision last_graph_precision = graph_precision;
+	cv::Size last_canvas_size = CanvasSize;
+	MontageCore::LabelMatchSettings last_settings = label_match_settings();
+	set_label_match_settings(Settings);
+	graph_precision = GraphPrecision::Double;
+	grid_maxflow = false;
+	parallel_maxflow_min_threads = 0;
+	GCoptimization::GraphPool preview_graphs;
+	label_match_pool = &preview_graphs;
+	large_penalty = LargePenalty;
+	smooth_alpha = SmoothAlpha;
+	smooth_type = SmoothType;
+	label_match_time_budget = preview_time_budget;
+	label_match_min_improvement = 0.0;
+	label_match_start_ticks = cv::getTickCount();
+	label_match_cancel = Cancel;
+	try
+	{
+		CanvasSize = Label.size();
+		InertiaPlanes = inertia_planes(Label, Images.size(), Scale);
+		CoverageMasks = coverage_masks(Coverage, Images.size());
+		Mat preview_label = SolveMRF(Images, Label, InertiaPlanes, CoverageMasks, Mat(), Mat());
+		VisResultLabelMap(preview_label, Images.size());
+		VisCompositeImage(preview_label, Images);
+	}
+	catch (GCException e)
+	{
+		TryAppendResultMsg(ResultMsg, e.message);
+	}
+	InertiaPlanes.clear();
+	CoverageMasks.clear();
+	CanvasSize = last_canvas_size;
+	label_match_pool = &label_match_graphs;
+	label_match_cancel = nullptr;
+	graph_precision = last_graph_precision;
+	large_penalty = last_large_penalty;
+	smooth_alpha = last_smooth_alpha;
+	smooth_type = last_smooth_type;
+	label_match_time_budget = last_time_budget;
+	label_match_min_improvement = last_min_improvement;
+	set_label_match_settings(last_settings);
+}
+
+void MontageCore::RunGradientFusion(GradientFusionSolverType SolverType)
+{
+	solver_type = SolverType;
+	// the solver needs the memory more than the next Label Match
+	label_match_graphs.clear();
+	BuildSolveGradientFusion(BufImages, BufResultLabel);
+}
+
+void MontageCore::BindResult(std::string* ResultMsg, cv::Mat* ResultLabel, cv::Mat* ResultImage)
+{
+	this->ResultMsg = ResultMsg;
+	if (this->ResultMsg != nullptr)
+		this->ResultMsg->clear();
+	this->ResultLabel = ResultLabel;
+	this->ResultImage = ResultImage;
+}
+
+void MontageCore::BindImageColors(const std::vector<Vec3b>* ImageColors)
+{
+	this->ImageColors = ImageColors;
+}
+
+void MontageCore::BindProgress(const std::function<void()>& Progress)
+{
+	this->Progress = Progress;
+}
+
+void MontageCore::SetLabelMatchSettings(const LabelMatchSettings& Settings)
+{
+	this->Settings = Settings;
+}
+
+void MontageCore::BindCancel(const std::atomic<bool>* Cancel)
+{
+	this->Cancel = Cancel;
+}
+
+bool MontageCore::IsCancelled() const
+{
+	return Cancel != nullptr && Cancel->load();
+}
+
+// Shows an intermediate labeling of the whole canvas through the bound results,
+// then lets the bound progress callback pick them up.
+void MontageCore::EmitProgress(const cv::Mat& Labeling, const std::vector<cv::Mat>& Images)
+{
+	if (!Progress || Labeling.size() != CanvasSize)
+		return;
+	VisResultLabelMap(Labeling, Images.size());
+	VisCompositeImage(Labeling, Images);
+	Progress();
+}
+
+static bool anytime_out_of_time()
+{
+	return label_match_time_budget > 0
+		&& (cv::getTickCount() - label_match_start_ticks) / cv::getTickFrequency()
+		> label_match_time_budget;
+}
+
+static bool anytime_should_stop(double EnergyBefore, double EnergyAfter)
+{
+	if (anytime_out_of_time())
+		return true;
+	return label_match_min_improvement > 0
+		&& EnergyBefore - EnergyAfter < label_match_min_improvement * std::abs(EnergyBefore);
+}
+
+// Rough peak memory of solve_labeling per pixel, in bytes:
+// label stack, seam cost table (if it is built), gco per-site arrays and the maxflow graph
+// (a node and 4 arcs per pixel, arcs are padded to 32 bytes whatever the precision;
+// the grid maxflow needs less, but graphs kept for reuse still take this much).
+static double label_match_bytes_per_pixel(int n_label)
+{
+	double stack = (double)n_label * LabelStack::cStride * sizeof(short) + sizeof(int);
+	double table = seam_table_bytes_per_pixel(n_label) + sizeof(int);
+	double gco = 4 * sizeof(int) + 3;
+	double graph = (graph_precision == MontageCore::GraphPrecision::Double ? 48 : 40) + 4 * 32;
+	return stack + table + gco + graph;
+}
+
+void MontageCore::BuildSolveMRF(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
+	const std::vector<cv::Mat>& Coverage)
+{
+	const int n_label = Images.size();
+	try
+	{
+		CanvasSize = Label.size();
+		keep_label_match_graphs_for(CanvasSize);
+		InertiaPlanes = inertia_planes(Label, n_label);
+		CoverageMasks = coverage_masks(Coverage, n_label);
+
+		Mat result_label = SolveIncremental(Images, Label);
+		if (result_label.empty())
+		{
+			if (label_match_mode == LabelMatchMode::Coarse_To_Fine)
+				result_label = SolveCoarseToFine(Images, Label);
+			else if (label_match_mode == LabelMatchMode::Tiled)
+				result_label = SolveTiled(Images, Label);
+			else if (label_match_mode == LabelMatchMode::Block_Parallel)
+				result_label = SolveBlockParallel(Images, Label);
+			else if (label_match_mode == LabelMatchMode::Pairwise_Seams)
+				result_label = SolvePairwiseSeams(Images, Label);
+			else if (label_match_mode == LabelMatchMode::Superpixel)
+				result_label = SolveSuperpixels(Images, Label);
+			else
+				result_label = SolveMRF(Images, Label, InertiaPlanes, CoverageMasks, Mat(), Mat());
+		}
+		InertiaPlanes.clear();
+
+		// buffer
+		BufImages = Images;
+		BufCoverage = CoverageMasks;
+		CoverageMasks.clear();
+		BufResultLabel = result_label;
+		BufLabel = Label.clone();
+
+		VisResultLabelMap(result_label, n_label);
+		VisCompositeImage(result_label, Images);
+	}
+	catch (GCException e)
+	{
+		e.Report();
+		TryAppendResultMsg(ResultMsg, e.message);
+		BufLabel.release();
+		InertiaPlanes.clear();
+		CoverageMasks.clear();
+		label_match_graphs.clear();
+	}
+}
+
+// Incremental Label Match:
+// if the sources are the same as last time, last result is kept as a warm start and
+// only the pixels within incremental_radius of strokes that changed are re-optimized,
+// in the bounding window of those pixels, whose outermost ring stays fixed.
+// Returns an empty Mat if last result can not be reused,
+// as with inertia, whose costs change everywhere when a stroke changes.
+cv::Mat MontageCore::SolveIncremental(const std::vector<cv::Mat>& Images, const cv::Mat& Label)
+{
+	if (BufLabel.empty() || BufLabel.size() != Label.size()
+		|| BufImages.size() != Images.size() || !InertiaPlanes.empty()
+		|| BufCoverage.size() != CoverageMasks.size())
+		return Mat();
+	for (size_t i = 0; i < Images.size(); i++)
+		if (BufImages[i].data != Images[i].data
+			&& (BufImages[i].size() != Images[i].size()
+				|| cv::norm(BufImages[i], Images[i], NORM_INF) != 0))
+			return Mat();
+	for (size_t i = 0; i < CoverageMasks.size(); i++)
+		if (cv::norm(BufCoverage[i], CoverageMasks[i], NORM_INF) != 0)
+			return Mat();
+
+	Mat region = BufLabel != Label;
+	if (cv::countNonZero(region) == 0)
+	{
+		TryAppendResultMsg(ResultMsg, "Strokes are unchanged, last result is kept");
+		return BufResultLabel.clone();
+	}
+	cv::dilate(region, region, cv::getStructuringElement(MORPH_ELLIPSE,
+		cv::Size(2 * incremental_radius + 1, 2 * incremental_radius + 1)));
+
+	Rect window = cv::boundingRect(region);
+	window = Rect(window.x - 1, window.y - 1, window.width + 2, window.height + 2)
+		& Rect(0, 0, Label.cols, Label.rows);
+	if (label_match_mode == LabelMatchMode::Tiled
+		&& window.area() * label_match_bytes_per_pixel(
+			active_labels(Label, BufResultLabel, Images.size()).size()) > label_match_memory_budget)
+		return Mat();
+
+	TryAppendResultMsg(ResultMsg, "Re-optimizing " + std::to_string(cv::countNonZero(region))
+		+ " pixels around changed strokes");
+
+	std::vector<Mat> window_images(Images.size());
+	for (size_t i = 0; i < Images.size(); i++)
+		window_images[i] = Images[i](window);
+	Mat result_label = BufResultLabel.clone();
+	Mat free_mask;
+	cv::threshold(region(window), free_mask, 0, 1, THRESH_BINARY);
+	SolveMRF(window_images, Label(window), planes_in(InertiaPlanes, window),
+		planes_in(CoverageMasks, window), BufResultLabel(window), free_mask)
+		.copyTo(result_label(window));
+	return result_label;
+}
+
+// Unstroked pixels whose colors differ by less than agreement_tolerance in every
+// channel across all sources. Any label gives the same color there and seams
+// through them cost ~0, so they are left out of the graphs.
+static cv::Mat agreement_mask(const std::vector<cv::Mat>& Images, const cv::Mat& Label)
+{
+	Mat lo = Images[0].clone(), hi = Images[0].clone();
+	for (size_t i = 1; i < Images.size(); i++)
+	{
+		check_label_match_cancel();
+		cv::min(lo, Images[i], lo);
+		cv::max(hi, Images[i], hi);
+	}
+	std::vector<Mat> spread;
+	cv::split(hi - lo, spread);
+	for (size_t c = 1; c < spread.size(); c++)
+		cv::max(spread[0], spread[c], spread[0]);
+	return (spread[0] < agreement_tolerance) & (Label < 0);
+}
+
+// Gives every non-zero pixel of Mask the label of the nearest zero pixel of it.
+static void fill_from_nearest(cv::Mat& Labeling, const cv::Mat& Mask)
+{
+	int n_known = Mask.total() - cv::countNonZero(Mask);
+	if (n_known == 0)
+		return;
+
+	// nearest holds the index (from 1, in scan order) of the closest zero pixel
+	Mat dist, nearest;
+	cv::distanceTransform(Mask, dist, nearest, DIST_L2, DIST_MASK_5, DIST_LABEL_PIXEL);
+	std::vector<ushort> known(n_known + 1, 0);
+	for (int y = 0; y < Mask.rows; y++)
+		for (int x = 0; x < Mask.cols; x++)
+			if (!Mask.at<uchar>(y, x))
+				known[nearest.at<int>(y, x)] = Labeling.at<ushort>(y, x);
+	for (int y = 0; y < Mask.rows; y++)
+		for (int x = 0; x < Mask.cols; x++)
+			if (Mask.at<uchar>(y, x))
+				Labeling.at<ushort>(y, x) = known[nearest.at<int>(y, x)];
+}
+
+// Energies before and after a cycle of solve_labeling, and a way to read
+// the labeling it reached; returns false to stop the optimization.
+typedef std::function<bool(double EnergyBefore, double EnergyAfter,
+	const std::function<cv::Mat()>& Labeling)> CycleCallback;
+
+// Solves the labeling of Images with gco and returns it as CV_16UC1.
+// Inertia (may be empty) holds the inertia planes of Label, see inertia_planes.
+// Coverage (may be empty) holds the coverage masks of the sources, see coverage_masks;
+// a source can then only be chosen where it has content, see set_coverage_data_costs.
+// InitLabel (CV_16UC1, may be empty) is the starting labeling,
+// if FreeMask (CV_8UC1, may be empty) is given, only its non-zero pixels may
+// change label, and colors/seam costs are only prepared around them.
+// Only the sources of active_labels take part: an unstroked pixel costs the same for
+// every label, so other sources have no data support. Memory then grows with the
+// stroked sources, not with all of them.
+// Pixels inside regions where all sources agree (see agreement_mask) and that all of
+// them cover are not optimized either,
+// they take the label of the nearest optimized or fixed pixel afterwards.
+// Several windows can be solved at once: their only shared state is the static
+// pool of label_match_pool, whose take and give are serialized inside GraphPool.
+// Graphs of all moves are kept for reuse if they fit in ReuseBudget bytes,
+// unless swaps run in parallel; their concurrent graphs cover disjoint pixels,
+// so together they are no larger than the graph of a single move.
+// Nor with coverage, as a kept graph spans every pixel instead of the covered ones.
+// OnCycle (may be empty) is called after every cycle that lowered the energy,
+// and stops the optimization by returning false.
+static cv::Mat solve_labeling(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
+	const std::vector<cv::Mat>& Inertia, const std::vector<cv::Mat>& Coverage,
+	const cv::Mat& InitLabel, const cv::Mat& FreeMask, int NumThreads, double ReuseBudget, double& EnergyBefore, double& EnergyAfter,
+	const CycleCallback& OnCycle = CycleCallback())
+{
+	const double cReusedGraphBytesPerPixel =
+		(graph_precision == MontageCore::GraphPrecision::Double ? 48 : 40) + 4 * 32 + 5 * sizeof(double);
+
+	const int n_imgs = Images.size();
+	int width = Label.cols;
+	int height = Label.rows;
+	int n_label = n_imgs;
+
+	check_label_match_cancel();
+
+	std::vector<int> active = active_labels(Label, InitLabel, n_imgs);
+	if (!Coverage.empty())
+		add_covering_labels(active, Coverage);
+	if ((int)active.size() < n_imgs)
+	{
+		// solve on the active sources only, and map their indices back
+		std::vector<int> compact(n_imgs, -1);
+		std::vector<Mat> active_images, active_inertia, active_coverage;
+		for (size_t i = 0; i < active.size(); i++)
+		{
+			compact[active[i]] = i;
+			active_images.push_back(Images[active[i]]);
+			if (!Inertia.empty())
+				active_inertia.push_back(Inertia[active[i]]);
+			if (!Coverage.empty())
+				active_coverage.push_back(Coverage[active[i]]);
+		}
+		CycleCallback on_cycle;
+		if (OnCycle)
+			on_cycle = [&](double Before, double After, const std::function<cv::Mat()>& Labeling)
+			{
+				return OnCycle(Before, After, [&]() { return remap_labels(Labeling(), active); });
+			};
+		Mat result = solve_labeling(active_images, remap_labels(Label, compact),
+			active_inertia, active_coverage, InitLabel.empty() ? Mat() : remap_labels(InitLabel, compact), FreeMask,
+			NumThreads, ReuseBudget, EnergyBefore, EnergyAfter, on_cycle);
+		return remap_labels(result, active);
+	}
+
+	// pixels whose label is decided afterwards by fill_from_nearest
+	Mat agree;
+	if (agreement_tolerance > 0)
+	{
+		agree = agreement_mask(Images, Label);
+		for (const Mat& mask : Coverage)
+			agree &= mask != 0;
+		if (!FreeMask.empty())
+			agree &= FreeMask != 0;
+		// only the interior is left out, so every edge between an optimized and a
+		// left out pixel joins two agreeing pixels, whose real seam cost is near 0
+		cv::erode(agree, agree, Mat());
+		if (cv::countNonZero(agree) == 0)
+			agree.release();
+	}
+
+	std::vector<GCoptimization::SiteID> free_sites;
+	Mat support;
+	if (!FreeMask.empty() || !agree.empty())
+	{
+		Mat free_mask = FreeMask.empty() ? Mat(height, width, CV_8UC1, Scalar(1)) : FreeMask;
+		if (!agree.empty())
+			free_mask = (free_mask != 0) & (agree == 0);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				if (free_mask.at<uchar>(y, x))
+					free_sites.push_back(y * width + x);
+		// free pixels and their neighbors take part in seam costs
+		cv::dilate(free_mask, support, Mat());
+	}
+	const bool restricted = !support.empty();
+
+	// seam costs are computed once here, expansions only look them up
+	SeamCostTable seam_costs;
+	{
+		// colors and signed gradients of all sources, interleaved per pixel
+		LabelStack stack;
+		stack.Build(Images, support);
+		seam_costs.Build(std::move(stack), label_match_memory_budget);
+	}
+
+	InertiaDataCost inertia_costs(Label, Inertia);
+	check_label_match_cancel();
+
+	GCoptimizationGridGraph* gc = new GCoptimizationGridGraph(width, height, n_imgs);
+	try
+	{
+		// data costs are only registered for stroked pixels,
+		// unless inertia gives every pixel a cost or coverage lists the feasible ones
+		if (!Coverage.empty())
+			set_coverage_data_costs(gc, Label, Inertia, Coverage);
+		else if (Inertia.empty())
+			set_stroke_data_costs(gc, Label, n_label);
+		else
+			gc->setDataCostFunctor(&inertia_costs);
+
+		// smoothness comes from precomputed table
+		gc->setSmoothCostFunctor(&seam_costs);
+		// graphs of moves are reset and reused rather than allocated per move
+		gc->setGraphPool(label_match_pool);
+		gc->setGridMaxflow(grid_maxflow);
+		gc->setParallelMaxflow(parallel_maxflow_min_threads > 0 && NumThreads >= parallel_maxflow_min_threads);
+
+		// seam costs and inertia are read-only, so moves can be built in parallel;
+		// gco reads the sparse stroke and coverage costs on one thread per label
+		gc->setNumThreads(NumThreads);
+		gc->setInterruptFlag(label_match_cancel);
+
+		if (graph_precision == MontageCore::GraphPrecision::Float)
+			gc->setGraphPrecision(GCoptimization::GraphFloat);
+		else if (graph_precision == MontageCore::GraphPrecision::Int32)
+		{
+			// seam costs keep 4 bits of headroom below the clamp, as a node sums
+			// up to 4 of them; larger terms (strokes, X_Divide_By_Z spikes) are clamped
+			double max_term = seam_costs.MaxTerm();
+			if (!(max_term > 0))
+				max_term = 1.0;
+			gc->setGraphPrecision(GCoptimization::GraphInt32,
+				GCO_MAX_GRAPHTERM_INT32 / (16 * max_term));
+		}
+
+		// with coverage the default labeling of 0 may be infeasible
+		Mat init_label = Coverage.empty() ? InitLabel : feasible_labeling(Label, InitLabel, Coverage);
+		if (!init_label.empty())
+			for (int y = 0; y < height; y++)
+				for (int x = 0; x < width; x++)
+					gc->setLabel(y * width + x, init_label.at<ushort>(y, x));
+		if (restricted)
+			gc->setFreeSites(free_sites.data(), free_sites.size());
+
+		// swaps of label pairs with disjoint labels run concurrently,
+		// as the serial O(n_label^2) swaps of a cycle dominate with many sources
+		const bool use_swap = smooth_type == MontageCore::SmoothTermType::X_Divide_By_Z;
+		const bool parallel_swaps = use_swap && NumThreads > 1 && n_label >= 4;
+		gc->setParallelSwaps(parallel_swaps);
+
+		// later cycles change few labels, so moves repeated on kept graphs are cheap
+		double n_moves = use_swap ? n_label * (n_label - 1) / 2 : n_label;
+		double n_movable = restricted ? free_sites.size() : (double)width * height;
+		// with two sources the labeling is a single binary cut, which one swap of the
+		// two labels over every pixel solves exactly, as seams cost 0 within a source
+		const bool single_cut = n_label == 2;
+		if (!single_cut && !parallel_swaps && Coverage.empty()
+			&& n_moves * n_movable * cReusedGraphBytesPerPixel <= ReuseBudget)
+			gc->setGraphReuse(true);
+
+		auto read_labeling = [&]()
+		{
+			Mat result_label(height, width, CV_16UC1);
+
+			for (int y = 0; y < height; y++)
+			{
+				for (int x = 0; x < width; x++)
+				{
+					int idx = y * width + x;
+
+					result_label.at<ushort>(y, x) = gc->whatLabel(idx);
+				}
+			}
+			if (!agree.empty())
+				fill_from_nearest(result_label, agree);
+			return result_label;
+		};
+
+		// swap runs until a cycle no longer lowers the energy, expansion 2 cycles,
+		// one at a time so that OnCycle sees every one of them
+		const int n_cycles = use_swap ? INT_MAX : 2;
+		EnergyBefore = gc->compute_energy();
+		EnergyAfter = EnergyBefore;
+		// nothing to optimize if every pixel is fixed or agreeing
+		if (single_cut && (!restricted || !free_sites.empty()))
+			gc->alpha_beta_swap(0, 1);
+		else if (!restricted || !free_sites.empty())
+			for (int cycle = 0; cycle < n_cycles; cycle++)
+			{
+				double energy = use_swap ? gc->swap(1) : gc->expansion(1);
+				double last = EnergyAfter;
+				EnergyAfter = energy;
+				if (energy >= last)
+					break;
+				if (OnCycle && !OnCycle(last, energy, read_labeling))
+					break;
+			}
+		EnergyAfter = gc->compute_energy();
+
+		Mat result_label = read_labeling();
+		delete gc;
+		return result_label;
+	}
+	catch (...)
+	{
+		delete gc;
+		throw;
+	}
+}
+
+cv::Mat MontageCore::SolveMRF(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
+	const std::vector<cv::Mat>& Inertia, const std::vector<cv::Mat>& Coverage,
+	const cv::Mat& InitLabel, const cv::Mat& FreeMask)
+{
+	int n_cycles = 0;
+	bool stopped = false;
+	auto on_cycle = [&](double EnergyBefore, double EnergyAfter,
+		const std::function<cv::Mat()>& Labeling)
+	{
+		n_cycles++;
+		if (Progress && Label.size() == CanvasSize)
+			EmitProgress(Labeling(), Images);
+		stopped = anytime_should_stop(EnergyBefore, EnergyAfter);
+		return !stopped;
+	};
+
+	double before, after;
+	Mat result_label = solve_labeling(Images, Label, Inertia, Coverage, InitLabel, FreeMask,
+		cv::getNumberOfCPUs(), label_match_memory_budget, before, after, on_cycle);
+	if (stopped)
+		TryAppendResultMsg(ResultMsg, "Stopped early after " + std::to_string(n_cycles) + " cycles");
+
+	printf("\nBefore optimization energy is %f", before);
+	printf("\nAfter optimization energy is %f", after);
+
+	std::string prnt = "Before optimization energy is ";
+	TryAppendResultMsg(
+		ResultMsg,
+		prnt + std::to_string(before)
+	);
+	prnt = "After optimization energy is ";
+	TryAppendResultMsg(
+		ResultMsg,
+		prnt + std::to_string(after)
+	);
+	return result_label;
+}
 
-struct __ExtraData
+int MontageCore::CoarseScale(int Width, int Height, double MaxPixels)
 {
-	std::vector<cv::Mat> Images;
-	std::vector<cv::Mat> XGrads[3];
-	std::vector<cv::Mat> YGrads[3];
-	cv::Mat Label;
-	cv::flann::Index* kdtree;
-};
+	int scale = 1;
+	while ((double)Width * Height / ((double)scale * scale) > MaxPixels
+		&& Width / (scale * 2) > 1 && Height / (scale * 2) > 1)
+		scale *= 2;
+	return scale;
+}
 
-GCoptimization::EnergyType dataFn(int p, int l, void* data)
+// Solves Label Match on a level downsampled by a power of 2 so that
+// it has at most MaxPixels pixels, and returns the labeling upsampled to full resolution.
+// Scale is set to the downsampling factor.
+cv::Mat MontageCore::SolveCoarse(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
+	double MaxPixels, int& Scale)
 {
-	__ExtraData* ptr_extra_data = (__ExtraData*)data;
-	cv::Mat& Label = ptr_extra_data->Label;
-	//cv::flann::Index * ptr_kdtree = ptr_extra_data->kdtree;
-
 	int width = Label.cols;
 	int height = Label.rows;
+	Scale = CoarseScale(width, height, MaxPixels);
+	if (Scale == 1)
+		return SolveMRF(Images, Label, InertiaPlanes, CoverageMasks, Mat(), Mat());
 
-	int y = p / width;
-	int x = p % width;
+	cv::Size coarse_size((width + Scale - 1) / Scale, (height + Scale - 1) / Scale);
+	std::vector<Mat> coarse_images(Images.size());
+	for (size_t i = 0; i < Images.size(); i++)
+		cv::resize(Images[i], coarse_images[i], coarse_size, 0, 0, INTER_AREA);
 
-	assert(l >= 0);
-	if (Label.at<char>(y, x) != MontageCore::undefined)	// user specified
-	{
-		if (Label.at<char>(y, x) == l)
-			return 0.0;
-		else
-			return large_penalty;
-	}
-	else
-		return large_penalty;
+	// keep every stroke, even thin ones, on the coarse level
+	Mat coarse_label(coarse_size, CV_16SC1, Scalar(MontageCore::undefined));
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			if (Label.at<short>(y, x) != MontageCore::undefined)
+				coarse_label.at<short>(y * coarse_size.height / height, x * coarse_size.width / width)
+				= Label.at<short>(y, x);
+
+	TryAppendResultMsg(ResultMsg, "Coarse level is " + std::to_string(coarse_size.width)
+		+ "x" + std::to_string(coarse_size.height));
+	std::vector<Mat> coarse_coverage(CoverageMasks.size());
+	for (size_t i = 0; i < CoverageMasks.size(); i++)
+		cv::resize(CoverageMasks[i], coarse_coverage[i], coarse_size, 0, 0, INTER_NEAREST);
+	Mat coarse_result = SolveMRF(coarse_images, coarse_label,
+		inertia_planes(coarse_label, Images.size(), Scale), coarse_coverage, Mat(), Mat());
+
+	Mat init_label;
+	cv::resize(coarse_result, init_label, Label.size(), 0, 0, INTER_NEAREST);
+	EmitProgress(init_label, Images);
+	return init_label;
 }
 
-static GCoptimization::EnergyType euc_dist(const Vec3b& a, const Vec3b& b)
+// Pixels (1 in a CV_8UC1 mask) within Radius of a seam of Labeling
+// or of a stroke of Label it disagrees with.
+static cv::Mat seam_band(const cv::Mat& Labeling, const cv::Mat& Label, int Radius)
 {
-	Vec3d double_diff = a - b;
-	return sqrt(double_diff[0] * double_diff[0] + double_diff[1] * double_diff[1] + double_diff[2] * double_diff[2]);
+	int width = Label.cols;
+	int height = Label.rows;
+	Mat band(Label.size(), CV_8UC1, Scalar(0));
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+		{
+			ushort l = Labeling.at<ushort>(y, x);
+			if (x + 1 < width && Labeling.at<ushort>(y, x + 1) != l)
+				band.at<uchar>(y, x) = band.at<uchar>(y, x + 1) = 1;
+			if (y + 1 < height && Labeling.at<ushort>(y + 1, x) != l)
+				band.at<uchar>(y, x) = band.at<uchar>(y + 1, x) = 1;
+			short stroke = Label.at<short>(y, x);
+			if (stroke != MontageCore::undefined && stroke != l)
+				band.at<uchar>(y, x) = 1;
+		}
+	cv::dilate(band, band, cv::getStructuringElement(
+		MORPH_RECT, cv::Size(2 * Radius + 1, 2 * Radius + 1)));
+	return band;
 }
 
-static GCoptimization::EnergyType six_comp_grad(
-	int xp, int yp, int xq, int yq, int lp, int lq,
-	const std::vector<cv::Mat>* XGrads, std::vector<cv::Mat>* YGrads)
+// Coarse-to-fine Label Match:
+// the labeling is solved on a downsampled level and upsampled,
+// then the full resolution graph cut only runs in a band around the upsampled seams.
+cv::Mat MontageCore::SolveCoarseToFine(const std::vector<cv::Mat>& Images, const cv::Mat& Label)
 {
-	GCoptimization::EnergyType double_diff;
-	Vec3b vlp = Vec3b(
-		YGrads[0][lp].at<uchar>(yp, xp),
-		YGrads[1][lp].at<uchar>(yp, xp),
-		YGrads[2][lp].at<uchar>(yp, xp)
-	);
-	Vec3b vlq = Vec3b(
-		YGrads[0][lq].at<uchar>(yp, xp),
-		YGrads[1][lq].at<uchar>(yp, xp),
-		YGrads[2][lq].at<uchar>(yp, xp)
-	);
-	double_diff = euc_dist(vlp, vlq);
-
-	vlp = Vec3b(
-		YGrads[0][lp].at<uchar>(yq, xq),
-		YGrads[1][lp].at<uchar>(yq, xq),
-		YGrads[2][lp].at<uchar>(yq, xq)
-	);
-	vlq = Vec3b(
-		YGrads[0][lq].at<uchar>(yq, xq),
-		YGrads[1][lq].at<uchar>(yq, xq),
-		YGrads[2][lq].at<uchar>(yq, xq)
-	);
-	double_diff += euc_dist(vlp, vlq);
-
-	vlp = Vec3b(
-		XGrads[0][lp].at<uchar>(yp, xp),
-		XGrads[1][lp].at<uchar>(yp, xp),
-		XGrads[2][lp].at<uchar>(yp, xp)
-	);
-	vlq = Vec3b(
-		XGrads[0][lq].at<uchar>(yp, xp),
-		XGrads[1][lq].at<uchar>(yp, xp),
-		XGrads[2][lq].at<uchar>(yp, xp)
-	);
-	double_diff += euc_dist(vlp, vlq);
+	const int cCoarsePixels = 512 * 512; // coarse level is at most this large
+	const int cBandRadius = 2; // in coarse pixels
+
+	int scale;
+	Mat init_label = SolveCoarse(Images, Label, cCoarsePixels, scale);
+	if (scale == 1)
+		return init_label;
+	if (anytime_out_of_time())
+	{
+		TryAppendResultMsg(ResultMsg, "Time budget is used up, coarse labeling is kept");
+		return init_label;
+	}
 
-	vlp = Vec3b(
-		XGrads[0][lp].at<uchar>(yq, xq),
-		XGrads[1][lp].at<uchar>(yq, xq),
-		XGrads[2][lp].at<uchar>(yq, xq)
-	);
-	vlq = Vec3b(
-		XGrads[0][lq].at<uchar>(yq, xq),
-		XGrads[1][lq].at<uchar>(yq, xq),
-		XGrads[2][lq].at<uchar>(yq, xq)
-	);
-	double_diff += euc_dist(vlp, vlq);
-	return double_diff;
+	Mat band = seam_band(init_label, Label, cBandRadius * scale);
+	TryAppendResultMsg(ResultMsg, "Refining " + std::to_string(cv::countNonZero(band))
+		+ " pixels at full resolution");
+	if (cv::countNonZero(band) == 0)
+		return init_label;
+	return SolveMRF(Images, Label, InertiaPlanes, CoverageMasks, init_label, band);
 }
 
-static GCoptimization::EnergyType edge_potential(int x, int y,
-	const cv::Mat& rGrad, const cv::Mat& gGrad, const cv::Mat& bGrad)
+// Cells of a grid of Cell x Cell pixels over a canvas of Size, shifted up-left by Shift.
+static std::vector<cv::Rect> grid_cells(cv::Size Size, int Cell, int Shift)
 {
-	GCoptimization::EnergyType r, g, b;
-	r = rGrad.at<uchar>(y, x);
-	g = gGrad.at<uchar>(y, x);
-	b = bGrad.at<uchar>(y, x);
-	return sqrt(r * r + g * g + b * b);
+	std::vector<Rect> cells;
+	for (int y0 = -Shift; y0 < Size.height; y0 += Cell)
+		for (int x0 = -Shift; x0 < Size.width; x0 += Cell)
+		{
+			Rect cell = Rect(x0, y0, Cell, Cell) & Rect(Point(0, 0), Size);
+			if (cell.area() > 0)
+				cells.push_back(cell);
+		}
+	return cells;
 }
 
-double smoothFn(int p, int q, int lp, int lq, void* data)
+// Solves each of Cores in a window enlarged by Overlap, whose outermost ring is fixed to
+// Labeling (except on the canvas border), and writes the labeling of the core to Next.
+// Cores must not overlap; they are solved concurrently, NumConcurrent at once,
+// each with NumInnerThreads. Energies of all windows are summed up.
+static void solve_windows(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
+	const std::vector<cv::Mat>& Inertia, const std::vector<cv::Mat>& Coverage, const cv::Mat& Labeling, cv::Mat& Next, const std::vector<cv::Rect>& Cores, int Overlap,
+	int NumConcurrent, int NumInnerThreads, double& EnergyBefore, double& EnergyAfter)
 {
-	if (lp == lq)
+	const int n_label = Images.size();
+	int width = Label.cols;
+	int height = Label.rows;
+
+	double energy_before = 0, energy_after = 0;
+	const char* error = nullptr; // gco messages are literals
+	auto stop_check = [](double EnergyBefore, double EnergyAfter,
+		const std::function<cv::Mat()>&)
 	{
-		return 0.0;
+		return !anytime_should_stop(EnergyBefore, EnergyAfter);
+	};
+#pragma omp parallel for schedule(dynamic) num_threads(NumConcurrent) reduction(+:energy_before, energy_after)
+	for (int t = 0; t < (int)Cores.size(); t++)
+	{
+		const Rect& core = Cores[t];
+		Rect window = Rect(core.x - Overlap, core.y - Overlap,
+			core.width + 2 * Overlap, core.height + 2 * Overlap)
+			& Rect(0, 0, width, height);
+
+		// the window border is fixed to the neighbors, except on the canvas border
+		Rect inner(0, 0, window.width, window.height);
+		if (window.x > 0) { inner.x++; inner.width--; }
+		if (window.y > 0) { inner.y++; inner.height--; }
+		if (window.x + window.width < width) inner.width--;
+		if (window.y + window.height < height) inner.height--;
+		Mat free_mask(window.size(), CV_8UC1, Scalar(0));
+		free_mask(inner).setTo(1);
+
+		std::vector<Mat> window_images(n_label);
+		for (int i = 0; i < n_label; i++)
+			window_images[i] = Images[i](window);
+
+		try
+		{
+			double before, after;
+			Mat result = solve_labeling(window_images, Label(window),
+				planes_in(Inertia, window), planes_in(Coverage, window), Labeling(window), free_mask,
+				NumInnerThreads, 0, before, after, stop_check);
+			result(core - window.tl()).copyTo(Next(core));
+			energy_before += before;
+			energy_after += after;
+		}
+		catch (GCException e)
+		{
+#pragma omp critical(solve_windows_error)
+			if (!error)
+				error = e.message;
+		}
+		catch (...)
+		{
+#pragma omp critical(solve_windows_error)
+			if (!error)
+				error = "Failed to solve a window";
+		}
 	}
+	if (error)
+		throw GCException(error);
+	EnergyBefore = energy_before;
+	EnergyAfter = energy_after;
+}
 
-	__ExtraData* ptr_extra_data = (__ExtraData*)data;
-	cv::Mat& Label = ptr_extra_data->Label;
-	std::vector<cv::Mat>& Images = ptr_extra_data->Images;
-	std::vector<cv::Mat>* XGrads = ptr_extra_data->XGrads;
-	std::vector<cv::Mat>* YGrads = ptr_extra_data->YGrads;
-	int n_label = Images.size();
-	assert(lp < n_label&& lq < n_label);
+// Tiled Label Match, for canvases whose graph does not fit in memory:
+// 1. a coarse level that fits in label_match_memory_budget gives the initial labeling,
+// 2. the canvas is split into tiles, each solved in a window enlarged by cTileOverlap
+//    whose outermost ring is fixed to the current labeling; only the tile itself is kept,
+// 3. the same is repeated on tiles shifted by half a tile, which reconciles the seams
+//    along the borders of the first tiling.
+// Tiles of a pass read the labeling of the previous pass, so they are solved concurrently,
+// as many at once as label_match_memory_budget allows.
+cv::Mat MontageCore::SolveTiled(const std::vector<cv::Mat>& Images, const cv::Mat& Label)
+{
+	const int cTileOverlap = 32;
+	const int cMinTile = 128;
 
+	const int n_label = Images.size();
 	int width = Label.cols;
 	int height = Label.rows;
+	// windows only hold the stroked sources, see solve_labeling
+	double bytes_per_pixel = label_match_bytes_per_pixel(active_labels(Label, Mat(), n_label).size());
+	double budget_pixels = label_match_memory_budget / bytes_per_pixel;
+	if ((double)width * height <= budget_pixels)
+		return SolveMRF(Images, Label, InertiaPlanes, CoverageMasks, Mat(), Mat());
+
+	// pick the most concurrent tiles that are still of reasonable size
+	int n_concurrent = cv::getNumberOfCPUs();
+	int tile;
+	for (;;)
+	{
+		int window = (int)std::sqrt(budget_pixels / n_concurrent);
+		tile = window - 2 * cTileOverlap;
+		if (tile >= cMinTile || n_concurrent == 1)
+			break;
+		n_concurrent--;
+	}
+	if (tile < cMinTile)
+		tile = cMinTile; // budget is too small, stay as close as possible
+	int n_inner_threads = std::max(1, cv::getNumberOfCPUs() / n_concurrent);
 
-	int yp = p / width;
-	int xp = p % width;
-	int yq = q / width;
-	int xq = q % width;
+	int scale;
+	Mat labeling = SolveCoarse(Images, Label, budget_pixels, scale);
 
-	double X_term = euc_dist(Images[lp].at<Vec3b>(yp, xp), Images[lq].at<Vec3b>(yp, xp));
-	X_term += euc_dist(Images[lp].at<Vec3b>(yq, xq), Images[lq].at<Vec3b>(yq, xq));
-	X_term *= smooth_alpha;
+	TryAppendResultMsg(ResultMsg, "Tile size is " + std::to_string(tile)
+		+ ", " + std::to_string(n_concurrent) + " tiles at once");
 
-	if (smooth_type == MontageCore::SmoothTermType::X)
-		return X_term;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		if (anytime_out_of_time())
+		{
+			TryAppendResultMsg(ResultMsg, "Time budget is used up, tiling stops");
+			break;
+		}
+		std::vector<Rect> tiles = grid_cells(Label.size(), tile, pass == 0 ? 0 : tile / 2);
 
-	if (smooth_type == MontageCore::SmoothTermType::X_Plus_Y)
+		Mat next = labeling.clone();
+		double energy_before, energy_after;
+		solve_windows(Images, Label, InertiaPlanes, CoverageMasks, labeling, next, tiles, cTileOverlap,
+			n_concurrent, n_inner_threads, energy_before, energy_after);
+		labeling = next;
+
+		std::string prnt = "Tiling pass " + std::to_string(pass + 1) + ", "
+			+ std::to_string(tiles.size()) + " tiles, window energy ";
+		TryAppendResultMsg(
+			ResultMsg,
+			prnt + std::to_string(energy_before) + " -> " + std::to_string(energy_after)
+		);
+		EmitProgress(labeling, Images);
+	}
+	return labeling;
+}
+
+// Block-parallel Label Match:
+// after a coarse initial labeling, the canvas is split into cBlock x cBlock blocks colored
+// like a checkerboard. Blocks of one color share no edge, so they are optimized concurrently,
+// each with its one pixel ring fixed, and every block can only lower the total energy.
+// Rounds alternate the block offset so that seams can cross block borders,
+// until a round no longer lowers the energy.
+cv::Mat MontageCore::SolveBlockParallel(const std::vector<cv::Mat>& Images, const cv::Mat& Label)
+{
+	const int cCoarsePixels = 512 * 512;
+	const int cBlock = 256;
+	const int cMaxRounds = 4;
+
+	int scale;
+	Mat labeling = SolveCoarse(Images, Label, cCoarsePixels, scale);
+	if (scale == 1)
+		return labeling;
+
+	int n_threads = cv::getNumberOfCPUs();
+	for (int round = 0; round < cMaxRounds; round++)
 	{
-		double Y_term = six_comp_grad(xp, yp, xq, yq, lp, lq, XGrads, YGrads);
-		Y_term = X_term + Y_term;
-		return Y_term;
+		if (anytime_out_of_time())
+		{
+			TryAppendResultMsg(ResultMsg, "Time budget is used up, block rounds stop");
+			break;
+		}
+		int shift = round % 2 == 0 ? 0 : cBlock / 2;
+		std::vector<Rect> blocks = grid_cells(Label.size(), cBlock, shift);
+
+		double round_before = 0, round_after = 0;
+		for (int color = 0; color < 2; color++)
+		{
+			std::vector<Rect> colored;
+			for (size_t b = 0; b < blocks.size(); b++)
+			{
+				int bx = (blocks[b].x + shift) / cBlock;
+				int by = (blocks[b].y + shift) / cBlock;
+				if ((bx + by) % 2 == color)
+					colored.push_back(blocks[b]);
+			}
+
+			Mat next = labeling.clone();
+			double energy_before, energy_after;
+			solve_windows(Images, Label, InertiaPlanes, CoverageMasks, labeling, next, colored, 1,
+				n_threads, 1, energy_before, energy_after);
+			labeling = next;
+			round_before += energy_before;
+			round_after += energy_after;
+		}
+
+		std::string prnt = "Block round " + std::to_string(round + 1) + ", "
+			+ std::to_string(blocks.size()) + " blocks, energy change ";
+		TryAppendResultMsg(
+			ResultMsg,
+			prnt + std::to_string(round_after - round_before)
+		);
+		EmitProgress(labeling, Images);
+		if (round_after >= round_before || anytime_should_stop(round_before, round_after))
+			break;
 	}
+	return labeling;
+}
 
-	double Z_term = 0.0;
-	if (xp != xq)
+// Pairwise-seam Label Match, for panoramas whose sources only overlap their neighbors:
+// sources are ordered by the centroid of their coverage along the longer axis of the
+// strip, and the seam of each consecutive pair is one binary cut inside their overlap,
+// where the rest of the overlap window is fixed to the source that alone covers it.
+// Overlaps are solved concurrently, as many at once as label_match_memory_budget allows.
+// Sources are then laid over each other in order, each one cut along its seam with the
+// previous one, so the work grows with the overlap area rather than with the canvas.
+// A stroke of a later source in an overlap keeps the later source, of an earlier one
+// the earlier source. Without coverage the sources overlap everywhere, and where a source
+// overlaps another one than its neighbors in the order (e.g. three sources cover a pixel)
+// one seam per pair can not decide the pixel, so the canvas is solved as a whole.
+cv::Mat MontageCore::SolvePairwiseSeams(const std::vector<cv::Mat>& Images, const cv::Mat& Label)
+{
+	const int n_label = Images.size();
+	int width = Label.cols;
+	int height = Label.rows;
+	if (CoverageMasks.empty())
 	{
-		// pixel p and q are horizonal neighbors
-		// find whether p-q is on an edge by calc vertical grad
-		int minX = xp < xq ? xp : xq;
-		Z_term = edge_potential(minX, yp, YGrads[0][lp], YGrads[1][lp], YGrads[2][lp]);
-		Z_term += edge_potential(minX, yp, YGrads[0][lq], YGrads[1][lq], YGrads[2][lq]);
+		TryAppendResultMsg(ResultMsg, "Sources cover the whole canvas, solving at full resolution");
+		return SolveMRF(Images, Label, InertiaPlanes, CoverageMasks, Mat(), Mat());
 	}
-	else
+
+	// order of the sources along the strip
+	std::vector<Point2d> centroids(n_label);
+	Point2d lo(DBL_MAX, DBL_MAX), hi(-DBL_MAX, -DBL_MAX);
+	for (int l = 0; l < n_label; l++)
 	{
-		// pixel p and q are vertical neighbors
-		// find whether p-q is on an edge by calc horizonal grad
-		int minY = yp < yq ? yp : yq;
-		Z_term = edge_potential(xp, minY, XGrads[0][lp], XGrads[1][lp], XGrads[2][lp]);
-		Z_term += edge_potential(xp, minY, XGrads[0][lq], XGrads[1][lq], XGrads[2][lq]);
+		cv::Moments m = cv::moments(CoverageMasks[l], true);
+		centroids[l] = m.m00 > 0 ? Point2d(m.m10 / m.m00, m.m01 / m.m00) : Point2d(width / 2.0, height / 2.0);
+		lo = Point2d(std::min(lo.x, centroids[l].x), std::min(lo.y, centroids[l].y));
+		hi = Point2d(std::max(hi.x, centroids[l].x), std::max(hi.y, centroids[l].y));
 	}
-	Z_term = X_term / Z_term;
+	const bool along_x = hi.x - lo.x >= hi.y - lo.y;
+	std::vector<int> order(n_label), position(n_label);
+	for (int l = 0; l < n_label; l++)
+		order[l] = l;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+	{
+		return along_x ? centroids[a].x < centroids[b].x : centroids[a].y < centroids[b].y;
+	});
+	for (int k = 0; k < n_label; k++)
+		position[order[k]] = k;
 
-	if (Z_term > large_penalty || Z_term != Z_term)
-		return large_penalty;
-	return Z_term;
-}
+	Mat earlier(height, width, CV_8UC1, Scalar(0));
+	for (int k = 2; k < n_label; k++)
+	{
+		earlier |= CoverageMasks[order[k - 2]] != 0;
+		if (cv::countNonZero(earlier & (CoverageMasks[order[k]] != 0)) > 0)
+		{
+			TryAppendResultMsg(ResultMsg, "Sources overlap beyond their neighbors, solving at full resolution");
+			return SolveMRF(Images, Label, InertiaPlanes, CoverageMasks, Mat(), Mat());
+		}
+	}
 
-// used to return message to GUI
-void TryAppendResultMsg(std::string* msg, const std::string& str)
-{
-	if (msg == nullptr)return;
-	msg->append(str + "\n");
-}
+	// overlap of each pair, in a window with a one pixel ring of fixed pixels
+	std::vector<Mat> overlaps(n_label);
+	std::vector<Rect> windows(n_label);
+	std::vector<int> pairs;
+	double largest = 0;
+	for (int k = 1; k < n_label; k++)
+	{
+		overlaps[k] = (CoverageMasks[order[k - 1]] != 0) & (CoverageMasks[order[k]] != 0);
+		if (cv::countNonZero(overlaps[k]) == 0)
+			continue;
+		Rect box = cv::boundingRect(overlaps[k]);
+		windows[k] = Rect(box.x - 1, box.y - 1, box.width + 2, box.height + 2) & Rect(0, 0, width, height);
+		largest = std::max(largest, (double)windows[k].area());
+		pairs.push_back(k);
+	}
 
-// used to return image or label to GUI
-static void TrySetResultMat(cv::Mat* mat, const cv::Mat& right)
-{
-	if (mat == nullptr)return;
-	(*mat) = right;
-}
+	int n_concurrent = std::max(1, std::min((int)pairs.size(), cv::getNumberOfCPUs()));
+	if (largest > 0)
+		n_concurrent = (int)std::max(1.0, std::min((double)n_concurrent,
+			label_match_memory_budget / (largest * label_match_bytes_per_pixel(2))));
+	int n_inner_threads = std::max(1, cv::getNumberOfCPUs() / n_concurrent);
+	std::vector<Mat> cuts(n_label);
+	const char* error = nullptr; // gco messages are literals
+#pragma omp parallel for schedule(dynamic) num_threads(n_concurrent)
+	for (int p = 0; p < (int)pairs.size(); p++)
+	{
+		const int k = pairs[p];
+		const int a = order[k - 1], b = order[k];
+		const Rect& window = windows[k];
+		try
+		{
+			// the pair as sources 0 and 1, strokes of other sources keep the side they are on
+			Mat pair_label(window.size(), CV_16SC1), init_label(window.size(), CV_16UC1);
+			for (int y = 0; y < window.height; y++)
+				for (int x = 0; x < window.width; x++)
+				{
+					short stroke = Label.at<short>(window.y + y, window.x + x);
+					pair_label.at<short>(y, x) = stroke == MontageCore::undefined ? stroke
+						: (short)(position[stroke] >= k ? 1 : 0);
+					init_label.at<ushort>(y, x) = CoverageMasks[a].at<uchar>(window.y + y, window.x + x) ? 0 : 1;
+				}
+			std::vector<Mat> pair_images = { Images[a](window), Images[b](window) };
+			std::vector<Mat> pair_coverage = { CoverageMasks[a](window), CoverageMasks[b](window) };
+			std::vector<Mat> pair_inertia;
+			if (!InertiaPlanes.empty())
+				pair_inertia = { InertiaPlanes[a](window), InertiaPlanes[b](window) };
+			Mat free_mask;
+			cv::threshold(overlaps[k](window), free_mask, 0, 1, THRESH_BINARY);
+
+			double before, after;
+			Mat cut = solve_labeling(pair_images, pair_label, pair_inertia, pair_coverage,
+				init_label, free_mask, n_inner_threads, 0, before, after);
+			cuts[k] = cut == 1;
+		}
+		catch (GCException e)
+		{
+#pragma omp critical(pairwise_seams_error)
+			if (!error)
+				error = e.message;
+		}
+		catch (...)
+		{
+#pragma omp critical(pairwise_seams_error)
+			if (!error)
+				error = "Failed to solve an overlap";
+		}
+	}
+	if (error)
+		throw GCException(error);
 
-void MontageCore::RunLabelMatch(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
-	double LargePenalty, double SmoothAlpha, SmoothTermType SmoothType)
-{
-	large_penalty = LargePenalty;
-	smooth_alpha = SmoothAlpha;
-	smooth_type = SmoothType;
-	BuildSolveMRF(Images, Label);
+	// each source covers the previous ones, except where its seam keeps the previous one
+	Mat labeling(height, width, CV_16UC1, Scalar(order[0]));
+	double overlap_pixels = 0;
+	for (int k = 1; k < n_label; k++)
+	{
+		Mat over = CoverageMasks[order[k]] != 0;
+		if (!cuts[k].empty())
+		{
+			over(windows[k]) &= (overlaps[k](windows[k]) == 0) | cuts[k];
+			overlap_pixels += cv::countNonZero(overlaps[k]);
+		}
+		labeling.setTo(order[k], over);
+	}
+	Mat any = covered_by_any(CoverageMasks);
+	if (cv::countNonZero(any) < (int)any.total())
+		fill_from_nearest(labeling, any == 0);
+	Mat strokes;
+	Label.convertTo(strokes, CV_16UC1);
+	strokes.copyTo(labeling, Label != MontageCore::undefined);
+
+	TryAppendResultMsg(ResultMsg, "Pairwise seams in " + std::to_string(pairs.size())
+		+ " overlaps, " + std::to_string((long long)overlap_pixels) + " pixels");
+	return labeling;
 }
 
-void MontageCore::RunGradientFusion(GradientFusionSolverType SolverType)
+// SLIC superpixels (Achanta et al., PAMI 2012) of the stack, about Step pixels across.
+// A pixel is described by the mean color of the sources and by their spread around it,
+// so that superpixels follow both the edges of the scene and the borders of the regions
+// where sources disagree, which is where seams go. Superpixels (CV_32SC1) is set to the
+// index of each pixel's superpixel; connectivity is not enforced, a superpixel may
+// have stray pieces. Returns the number of superpixels.
+static int slic_superpixels(const std::vector<cv::Mat>& Images, int Step, cv::Mat& Superpixels)
 {
-	solver_type = SolverType;
-	BuildSolveGradientFusion(BufImages, BufResultLabel);
-}
+	const int cIterations = 5;
+	const float cCompactness = 20.0f; // weight of a distance of Step pixels against color
 
-void MontageCore::BindResult(std::string* ResultMsg, cv::Mat* ResultLabel, cv::Mat* ResultImage)
-{
-	this->ResultMsg = ResultMsg;
-	if (this->ResultMsg != nullptr)
-		this->ResultMsg->clear();
-	this->ResultLabel = ResultLabel;
-	this->ResultImage = ResultImage;
+	const int n_imgs = Images.size();
+	int width = Images[0].cols;
+	int height = Images[0].rows;
+
+	// [ mean B, mean G, mean R, spread ]
+	Mat features(height, width, CV_32FC4);
+#pragma omp parallel for schedule(static)
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+		{
+			Vec3f sum(0, 0, 0), sum_sq(0, 0, 0);
+			for (int l = 0; l < n_imgs; l++)
+			{
+				Vec3f c = Images[l].at<Vec3b>(y, x);
+				sum += c;
+				sum_sq += c.mul(c);
+			}
+			Vec3f mean = sum / n_imgs;
+			Vec3f var = sum_sq / n_imgs - mean.mul(mean);
+			float spread = std::sqrt(std::max(0.0f, var[0] + var[1] + var[2]));
+			features.at<Vec4f>(y, x) = Vec4f(mean[0], mean[1], mean[2], spread);
+		}
+
+	struct Center
+	{
+		float x, y;
+		Vec4f f;
+	};
+	const int grid_w = (width + Step - 1) / Step;
+	const int grid_h = (height + Step - 1) / Step;
+	std::vector<Center> centers(grid_w * grid_h);
+	for (int gy = 0; gy < grid_h; gy++)
+		for (int gx = 0; gx < grid_w; gx++)
+		{
+			Center& c = centers[gy * grid_w + gx];
+			c.x = std::min(gx * Step + Step / 2, width - 1);
+			c.y = std::min(gy * Step + Step / 2, height - 1);
+			c.f = features.at<Vec4f>((int)c.y, (int)c.x);
+		}
+
+	const float spatial = (cCompactness / Step) * (cCompactness / Step);
+	Superpixels.create(height, width, CV_32SC1);
+	std::vector<double> sums;
+	for (int it = 0; it < cIterations; it++)
+	{
+		// centers move by less than a grid cell, so the 3 x 3 cells around a pixel hold its candidates
+#pragma omp parallel for schedule(static)
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+			{
+				const Vec4f& f = features.at<Vec4f>(y, x);
+				int gx = x / Step, gy = y / Step;
+				int best = gy * grid_w + gx;
+				float best_dist = FLT_MAX;
+				for (int cy = std::max(gy - 1, 0); cy <= std::min(gy + 1, grid_h - 1); cy++)
+					for (int cx = std::max(gx - 1, 0); cx <= std::min(gx + 1, grid_w - 1); cx++)
+					{
+						const Center& c = centers[cy * grid_w + cx];
+						Vec4f d = f - c.f;
+						float dx = x - c.x, dy = y - c.y;
+						float dist = d.dot(d) + spatial * (dx * dx + dy * dy);
+						if (dist < best_dist)
+						{
+							best_dist = dist;
+							best = cy * grid_w + cx;
+						}
+					}
+				Superpixels.at<int>(y, x) = best;
+			}
+
+		// centers move to the mean of their pixels, empty ones stay
+		sums.assign(centers.size() * 7, 0.0);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+			{
+				double* s = &sums[Superpixels.at<int>(y, x) * 7];
+				const Vec4f& f = features.at<Vec4f>(y, x);
+				s[0] += x;
+				s[1] += y;
+				for (int c = 0; c < 4; c++)
+					s[2 + c] += f[c];
+				s[6] += 1;
+			}
+		for (size_t k = 0; k < centers.size(); k++)
+		{
+			const double* s = &sums[k * 7];
+			if (s[6] == 0)
+				continue;
+			centers[k].x = s[0] / s[6];
+			centers[k].y = s[1] / s[6];
+			for (int c = 0; c < 4; c++)
+				centers[k].f[c] = s[2 + c] / s[6];
+		}
+	}
+
+	// indices of the superpixels that kept pixels
+	std::vector<int> compact(centers.size(), -1);
+	int n_superpixels = 0;
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+		{
+			int& s = Superpixels.at<int>(y, x);
+			if (compact[s] < 0)
+				compact[s] = n_superpixels++;
+			s = compact[s];
+		}
+	return n_superpixels;
 }
 
-void MontageCore::BindImageColors(const std::vector<Vec3b>* ImageColors)
+// Seam costs of the superpixel graph: the seam between two superpixels costs the sum of
+// the pixel seam costs along their shared boundary, read from a SeamCostTable built on
+// the pixels next to superpixel boundaries. Sums are capped at large_penalty, so that
+// long boundaries stay below the energy limit of gco.
+class SuperpixelSeamCost : public GCoptimization::SmoothCostFunctor
 {
-	this->ImageColors = ImageColors;
-}
+public:
+	SuperpixelSeamCost(SeamCostTable& PixelCosts) : PixelCosts(PixelCosts) {}
+	// Collects the boundaries of Superpixels (CV_32SC1) and the pixels next to them (Support).
+	void Build(const cv::Mat& Superpixels, int NumSuperpixels, cv::Mat& Support);
+	GCoptimization::EnergyTermType compute(
+		GCoptimization::SiteID s1, GCoptimization::SiteID s2,
+		GCoptimization::LabelID l1, GCoptimization::LabelID l2) override;
+
+	// adjacent superpixels, the lower index first
+	std::vector<std::pair<int, int>> Edges;
+private:
+	SeamCostTable& PixelCosts;
+	// pixel pairs of edge e are Pixels[2 * k], Pixels[2 * k + 1] for k in [PairFirst[e], PairFirst[e + 1]),
+	// the first pixel of a pair is in the superpixel of lower index
+	std::vector<int> PairFirst;
+	std::vector<int> Pixels;
+	// edges of superpixel s are AdjEdge[k] to AdjTo[k] for k in [AdjFirst[s], AdjFirst[s + 1])
+	std::vector<int> AdjFirst;
+	std::vector<int> AdjTo;
+	std::vector<int> AdjEdge;
+};
 
-void MontageCore::BuildSolveMRF(const std::vector<cv::Mat>& Images, const cv::Mat& Label)
+void SuperpixelSeamCost::Build(const cv::Mat& Superpixels, int NumSuperpixels, cv::Mat& Support)
 {
-	const int n_imgs = Images.size();
-	__ExtraData extra_data;
-	extra_data.Images.resize(n_imgs);
-	for (int i = 0; i < 3; i++)
+	int width = Superpixels.cols;
+	int height = Superpixels.rows;
+
+	// (lower superpixel, higher superpixel, pixel in lower, pixel in higher)
+	std::vector<std::array<int, 4>> pairs;
+	Support = Mat::zeros(height, width, CV_8UC1);
+	auto add_pair = [&](int x1, int y1, int x2, int y2)
+	{
+		int a = Superpixels.at<int>(y1, x1), b = Superpixels.at<int>(y2, x2);
+		if (a == b)
+			return;
+		int p = y1 * width + x1, q = y2 * width + x2;
+		if (a < b)
+			pairs.push_back({ a, b, p, q });
+		else
+			pairs.push_back({ b, a, q, p });
+		Support.at<uchar>(y1, x1) = Support.at<uchar>(y2, x2) = 1;
+	};
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+		{
+			if (x + 1 < width)
+				add_pair(x, y, x + 1, y);
+			if (y + 1 < height)
+				add_pair(x, y, x, y + 1);
+		}
+	std::sort(pairs.begin(), pairs.end());
+
+	Edges.clear();
+	PairFirst.clear();
+	Pixels.clear();
+	for (size_t k = 0; k < pairs.size(); k++)
+	{
+		if (k == 0 || pairs[k][0] != pairs[k - 1][0] || pairs[k][1] != pairs[k - 1][1])
+		{
+			Edges.push_back(std::make_pair(pairs[k][0], pairs[k][1]));
+			PairFirst.push_back(k);
+		}
+		Pixels.push_back(pairs[k][2]);
+		Pixels.push_back(pairs[k][3]);
+	}
+	PairFirst.push_back(pairs.size());
+
+	AdjFirst.assign(NumSuperpixels + 1, 0);
+	for (const auto& e : Edges)
 	{
-		extra_data.XGrads[i].resize(n_imgs);
-		extra_data.YGrads[i].resize(n_imgs);
+		AdjFirst[e.first + 1]++;
+		AdjFirst[e.second + 1]++;
 	}
-	std::vector<cv::Mat> rgbMats(3);
-	for (int i = 0; i < n_imgs; i++)
+	for (int s = 0; s < NumSuperpixels; s++)
+		AdjFirst[s + 1] += AdjFirst[s];
+	AdjTo.resize(AdjFirst[NumSuperpixels]);
+	AdjEdge.resize(AdjFirst[NumSuperpixels]);
+	std::vector<int> next(AdjFirst.begin(), AdjFirst.end() - 1);
+	for (int e = 0; e < (int)Edges.size(); e++)
 	{
-		extra_data.Images[i] = Images[i];
-		
-		cv::split(Images[i], rgbMats);
+		int a = Edges[e].first, b = Edges[e].second;
+		AdjTo[next[a]] = b;
+		AdjEdge[next[a]++] = e;
+		AdjTo[next[b]] = a;
+		AdjEdge[next[b]++] = e;
+	}
+}
 
-		assert(rgbMats.size() == 3);
-		for (int c = 0; c < 3; c++)
+GCoptimization::EnergyTermType SuperpixelSeamCost::compute(
+	GCoptimization::SiteID s1, GCoptimization::SiteID s2,
+	GCoptimization::LabelID l1, GCoptimization::LabelID l2)
+{
+	if (l1 == l2)
+		return 0;
+	int e = -1;
+	for (int k = AdjFirst[s1]; k < AdjFirst[s1 + 1]; k++)
+		if (AdjTo[k] == s2)
 		{
-			cv::Sobel(rgbMats[c], extra_data.XGrads[c][i], -1, 1, 0);
-			cv::Sobel(rgbMats[c], extra_data.YGrads[c][i], -1, 0, 1);
+			e = AdjEdge[k];
+			break;
 		}
-	}
-	extra_data.Label = Label;
+	if (e < 0)
+		return 0;
+	// labels in the order of the pixels of a pair
+	if (s1 > s2)
+		std::swap(l1, l2);
+	double cost = 0;
+	for (int k = PairFirst[e]; k < PairFirst[e + 1]; k++)
+		cost += PixelCosts.compute(Pixels[2 * k], Pixels[2 * k + 1], l1, l2);
+	return std::min(cost, large_penalty);
+}
+
+// Solves Label Match on the graph of Superpixels (CV_32SC1, NumSuperpixels of them),
+// and returns the labeling of their pixels.
+// A superpixel costs, for a source, large_penalty if the source breaks a stroke in it,
+// as a single broken stroke pixel does at full resolution; otherwise large_penalty
+// times the share of its pixels outside the coverage of the source, plus their inertia.
+static cv::Mat solve_superpixel_labeling(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
+	const std::vector<cv::Mat>& Inertia, const std::vector<cv::Mat>& Coverage,
+	const cv::Mat& Superpixels, int NumSuperpixels, int NumThreads)
+{
+	const int n_imgs = Images.size();
 	int width = Label.cols;
 	int height = Label.rows;
 	int n_label = n_imgs;
 
-	GCoptimizationGridGraph* gc = new GCoptimizationGridGraph(width, height, n_imgs);
-	try
-	{
-		// set up the needed data to pass to function for the data costs
-		gc->setDataCost(&dataFn, &extra_data);
+	check_label_match_cancel();
 
-		// smoothness comes from function pointer
-		gc->setSmoothCost(&smoothFn, &extra_data);
+	std::vector<int> active = active_labels(Label, Mat(), n_imgs);
+	if (!Coverage.empty())
+		add_covering_labels(active, Coverage);
+	if ((int)active.size() < n_imgs)
+	{
+		// solve on the active sources only, and map their indices back
+		std::vector<int> compact(n_imgs, -1);
+		std::vector<Mat> active_images, active_inertia, active_coverage;
+		for (size_t i = 0; i < active.size(); i++)
+		{
+			compact[active[i]] = i;
+			active_images.push_back(Images[active[i]]);
+			if (!Inertia.empty())
+				active_inertia.push_back(Inertia[active[i]]);
+			if (!Coverage.empty())
+				active_coverage.push_back(Coverage[active[i]]);
+		}
+		Mat result = solve_superpixel_labeling(active_images, remap_labels(Label, compact),
+			active_inertia, active_coverage, Superpixels, NumSuperpixels, NumThreads);
+		return remap_labels(result, active);
+	}
 
-		std::string prnt = "Before optimization energy is ";
-		TryAppendResultMsg(
-			ResultMsg,
-			prnt + std::to_string(gc->compute_energy())
-		);
+	// seam costs are only needed on both sides of superpixel boundaries
+	SeamCostTable seam_costs;
+	SuperpixelSeamCost superpixel_costs(seam_costs);
+	{
+		Mat support;
+		superpixel_costs.Build(Superpixels, NumSuperpixels, support);
+		LabelStack stack;
+		stack.Build(Images, support);
+		seam_costs.Build(std::move(stack), label_match_memory_budget);
+	}
+	check_label_match_cancel();
+
+	// dense data costs, superpixel-major as gco expects
+	std::vector<char> breaks_stroke((size_t)NumSuperpixels * n_label, 0);
+	std::vector<double> violations((size_t)NumSuperpixels * n_label, 0.0);
+	std::vector<double> inertia((size_t)NumSuperpixels * n_label, 0.0);
+	std::vector<int> sizes(NumSuperpixels, 0);
+	Mat any = Coverage.empty() ? Mat() : covered_by_any(Coverage);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+		{
+			int s = Superpixels.at<int>(y, x);
+			short stroke = Label.at<short>(y, x);
+			sizes[s]++;
+			for (int l = 0; l < n_label; l++)
+			{
+				size_t i = (size_t)s * n_label + l;
+				if (stroke != MontageCore::undefined && stroke != l)
+					breaks_stroke[i] = 1;
+				else if (!Coverage.empty() && stroke != l
+					&& !Coverage[l].at<uchar>(y, x) && any.at<uchar>(y, x))
+					violations[i] += 1;
+				if (stroke == MontageCore::undefined && !Inertia.empty())
+					inertia[i] += inertia_weight * Inertia[l].at<ushort>(y, x);
+			}
+		}
+	std::vector<GCoptimization::EnergyTermType> data_costs((size_t)NumSuperpixels * n_label);
+	for (int s = 0; s < NumSuperpixels; s++)
+		for (int l = 0; l < n_label; l++)
+		{
+			size_t i = (size_t)s * n_label + l;
+			double cost = large_penalty * violations[i] / sizes[s] + inertia[i];
+			data_costs[i] = breaks_stroke[i] ? large_penalty : std::min(cost, large_penalty);
+		}
 
-		printf("\nBefore optimization energy is %f", gc->compute_energy());
-		if (smooth_type == MontageCore::SmoothTermType::X_Divide_By_Z)
-			gc->swap(n_label * 2);// run expansion for 2 iterations. For swap use gc->swap(num_iterations);
+	GCoptimizationGeneralGraph* gc = new GCoptimizationGeneralGraph(NumSuperpixels, n_label);
+	try
+	{
+		gc->setDataCost(data_costs.data());
+		for (const auto& e : superpixel_costs.Edges)
+			gc->setNeighbors(e.first, e.second);
+		gc->setSmoothCostFunctor(&superpixel_costs);
+		gc->setNumThreads(NumThreads);
+		gc->setInterruptFlag(label_match_cancel);
+
+		// the graph is small, moves run until they converge
+		if (n_label == 2)
+			gc->alpha_beta_swap(0, 1);
+		else if (smooth_type == MontageCore::SmoothTermType::X_Divide_By_Z)
+			gc->swap(-1);
 		else
-			gc->expansion(2);
-		printf("\nAfter optimization energy is %f", gc->compute_energy());
-
-		prnt = "After optimization energy is ";
-		TryAppendResultMsg(
-			ResultMsg,
-			prnt + std::to_string(gc->compute_energy())
-		);
-
-		Mat result_label(height, width, CV_8UC1);
+			gc->expansion(-1);
 
+		Mat result_label(height, width, CV_16UC1);
 		for (int y = 0; y < height; y++)
-		{
 			for (int x = 0; x < width; x++)
-			{
-				int idx = y * width + x;
-
-				result_label.at<uchar>(y, x) = gc->whatLabel(idx);
-			}
-		}
+				result_label.at<ushort>(y, x) = gc->whatLabel(Superpixels.at<int>(y, x));
+		delete gc;
+		return result_label;
+	}
+	catch (...)
+	{
 		delete gc;
+		throw;
+	}
+}
 
-		// buffer
-		BufImages = Images;
-		BufResultLabel = result_label;
+// Superpixel Label Match: the stack is over-segmented into SLIC superpixels, a few hundred
+// times fewer than pixels, and Label Match is solved on the graph of superpixels first.
+// The full resolution cut then only runs in a band around the seams it found and the strokes
+// it breaks, so that seams snap to pixel accuracy. Small canvases are solved at full resolution.
+cv::Mat MontageCore::SolveSuperpixels(const std::vector<cv::Mat>& Images, const cv::Mat& Label)
+{
+	const int cSuperpixelStep = 16; // superpixels are about this many pixels across
+	const int cBandRadius = cSuperpixelStep / 2; // in pixels
 
-		VisResultLabelMap(result_label, n_label);
-		VisCompositeImage(result_label, Images);
+	int width = Label.cols;
+	int height = Label.rows;
+	if (width < 4 * cSuperpixelStep || height < 4 * cSuperpixelStep)
+		return SolveMRF(Images, Label, InertiaPlanes, CoverageMasks, Mat(), Mat());
+
+	Mat superpixels;
+	int n_superpixels = slic_superpixels(Images, cSuperpixelStep, superpixels);
+	TryAppendResultMsg(ResultMsg, "Solving on " + std::to_string(n_superpixels) + " superpixels");
+	Mat init_label = solve_superpixel_labeling(Images, Label, InertiaPlanes, CoverageMasks,
+		superpixels, n_superpixels, cv::getNumberOfCPUs());
+	EmitProgress(init_label, Images);
+	if (anytime_out_of_time())
+	{
+		TryAppendResultMsg(ResultMsg, "Time budget is used up, superpixel labeling is kept");
+		return init_label;
 	}
-	catch (GCException e)
+
+	Mat band = seam_band(init_label, Label, cBandRadius);
+	// pixels a superpixel took outside its source's coverage are refined as well
+	if (!CoverageMasks.empty())
 	{
-		e.Report();
-		TryAppendResultMsg(ResultMsg, e.message);
-		delete gc;
+		Mat any = covered_by_any(CoverageMasks);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				if (any.at<uchar>(y, x) && !CoverageMasks[init_label.at<ushort>(y, x)].at<uchar>(y, x))
+					band.at<uchar>(y, x) = 1;
 	}
+	TryAppendResultMsg(ResultMsg, "Refining " + std::to_string(cv::countNonZero(band))
+		+ " pixels at full resolution");
+	if (cv::countNonZero(band) == 0)
+		return init_label;
+	return SolveMRF(Images, Label, InertiaPlanes, CoverageMasks, init_label, band);
 }
 
 void MontageCore::GradientAt(const cv::Mat& Image, int x, int y, cv::Vec3f& grad_x, cv::Vec3f& grad_y)
@@ -453,7 +2355,7 @@ void MontageCore::BuildSolveGradientFusion(const std::vector<cv::Mat>& Images, c
 	{
 		for (int x = 0; x < width - 1; x++)
 		{
-			GradientAt(Images[ResultLabel.at<uchar>(y, x)], x, y, color_gradient_x.at<Vec3f>(y, x), color_gradient_y.at<Vec3f>(y, x));
+			GradientAt(Images[ResultLabel.at<ushort>(y, x)], x, y, color_gradient_x.at<Vec3f>(y, x), color_gradient_y.at<Vec3f>(y, x));
 		}
 	}
 
@@ -461,9 +2363,17 @@ void MontageCore::BuildSolveGradientFusion(const std::vector<cv::Mat>& Images, c
 	//Vec3b color0 = Images[0].at<Vec3b>(constraintY, constraintX);
 	Vec3b color0 = avgConstraintVec3b(Images);
 	prepareAandATA(color_gradient_x.rows, color_gradient_x.cols);
-	SolveChannel(0, color0[0], color_gradient_x, color_gradient_y, color_result);
-	SolveChannel(1, color0[1], color_gradient_x, color_gradient_y, color_result);
-	SolveChannel(2, color0[2], color_gradient_x, color_gradient_y, color_result);
+	for (int channel = 0; channel < 3; channel++)
+		if (!SolveChannel(channel, color0[channel], color_gradient_x, color_gradient_y, color_result))
+		{
+			// release the large systems, the next run prepares them again
+			A = Eigen::SparseMatrix<double>();
+			ATA = Eigen::SparseMatrix<double>();
+			myA = Kouek::SparseMat<double>();
+			myATA = Kouek::SparseMat<double>();
+			TryAppendResultMsg(ResultMsg, "Interrupted.");
+			return;
+		}
 
 	TrySetResultMat(this->ResultImage, color_result);
 }
@@ -486,7 +2396,7 @@ void MontageCore::VisResultLabelMap(const cv::Mat& ResultLabel, int n_label)
 	{
 		for (int x = 0; x < width; x++)
 		{
-			color_result_map.at<Vec3b>(y, x) = label_colors[ResultLabel.at<uchar>(y, x)];
+			color_result_map.at<Vec3b>(y, x) = label_colors[ResultLabel.at<ushort>(y, x)];
 		}
 	}
 
@@ -503,40 +2413,57 @@ void MontageCore::VisCompositeImage(const cv::Mat& ResultLabel, const std::vecto
 	{
 		for (int x = 0; x < width; x++)
 		{
-			composite_image.at<Vec3b>(y, x) = Images[ResultLabel.at<uchar>(y, x)].at<Vec3b>(y, x);
+			composite_image.at<Vec3b>(y, x) = Images[ResultLabel.at<ushort>(y, x)].at<Vec3b>(y, x);
 		}
 	}
 
 	TrySetResultMat(this->ResultImage, composite_image);
 }
 
-cv::flann::Index* MontageCore::AddInertiaConstraint(const cv::Mat& Label)
+// Same iteration as Eigen::ConjugateGradient with its default Jacobi preconditioner,
+// tolerance and max iterations, but checks *Cancel before every iteration
+static bool solve_conjugate_gradient(const Eigen::SparseMatrix<double>& M,
+	const Eigen::VectorXd& rhs, Eigen::VectorXd& x, const std::atomic<bool>* Cancel)
 {
-	int height = Label.rows;
-	int width = Label.cols;
-	std::vector<Point2f> _data_vec;
-	for (int y = 0; y < height; y++)
+	Eigen::Index n = M.cols();
+	x = Eigen::VectorXd::Zero(n);
+	Eigen::VectorXd inv_diag(n);
+	for (Eigen::Index i = 0; i < n; i++)
 	{
-		for (int x = 0; x < width; x++)
-		{
-			if (Label.at<char>(y, x) > 0)
-			{
-				_data_vec.push_back(Point2f(x, y));
-			}
-		}
+		double d = M.coeff(i, i);
+		inv_diag(i) = d == 0.0 ? 1.0 : 1.0 / d;
 	}
 
-	_data.create(_data_vec.size(), 2, CV_32FC1);
-	for (int i = 0; i < _data_vec.size(); i++)
+	double rhs_norm2 = rhs.squaredNorm();
+	if (rhs_norm2 == 0.0)
+		return true;
+	double tol = Eigen::NumTraits<double>::epsilon();
+	double threshold = std::max(tol * tol * rhs_norm2, (std::numeric_limits<double>::min)());
+	Eigen::Index max_iters = 2 * n;
+
+	Eigen::VectorXd residual = rhs;
+	Eigen::VectorXd p = inv_diag.cwiseProduct(residual);
+	Eigen::VectorXd z(n), tmp(n);
+	double abs_new = residual.dot(p);
+	for (Eigen::Index i = 0; i < max_iters; i++)
 	{
-		_data.at<float>(i, 0) = _data_vec[i].x;
-		_data.at<float>(i, 1) = _data_vec[i].y;
+		if (Cancel != nullptr && Cancel->load())
+			return false;
+		tmp.noalias() = M * p;
+		double alpha = abs_new / p.dot(tmp);
+		x += alpha * p;
+		residual -= alpha * tmp;
+		if (residual.squaredNorm() < threshold)
+			break;
+		z = inv_diag.cwiseProduct(residual);
+		double abs_old = abs_new;
+		abs_new = residual.dot(z);
+		p = z + (abs_new / abs_old) * p;
 	}
-	cv::flann::KDTreeIndexParams indexParams;
-	return new cv::flann::Index(_data, indexParams);
+	return true;
 }
 
-void MontageCore::SolveChannel(int channel_idx, int constraint, const cv::Mat& color_gradient_x, const cv::Mat& color_gradient_y, cv::Mat& output)
+bool MontageCore::SolveChannel(int channel_idx, int constraint, const cv::Mat& color_gradient_x, const cv::Mat& color_gradient_y, cv::Mat& output)
 {
 	int width = color_gradient_x.cols;
 	int height = color_gradient_x.rows;
@@ -569,8 +2496,9 @@ void MontageCore::SolveChannel(int channel_idx, int constraint, const cv::Mat& c
 		Eigen::VectorXd ATb = A.transpose() * b;
 
 		printf("\nSolving...\n");
-		Eigen::ConjugateGradient<Eigen::SparseMatrix<double>> CGSolver(ATA);
-		Eigen::VectorXd solution = CGSolver.solve(ATb);
+		Eigen::VectorXd solution;
+		if (!solve_conjugate_gradient(ATA, ATb, solution, Cancel))
+			return false;
 
 		Eigen::VectorXd solvAX = A * solution;
 		TryAppendResultMsg(
@@ -618,7 +2546,9 @@ void MontageCore::SolveChannel(int channel_idx, int constraint, const cv::Mat& c
 		vector<double> sol(ATb.size(), 0);
 		sol[constraintY * width + constraintX] = constraint; // set constraint
 		printf("\nSolving...\n");
-		bool ret = Kouek::SparseMat<double>::solveInConjugateGradient(myATA, sol, ATb, 10.0);
+		bool ret = Kouek::SparseMat<double>::solveInConjugateGradient(myATA, sol, ATb, 10.0, 1000, Cancel);
+		if (IsCancelled())
+			return false;
 		TryAppendResultMsg(
 			ResultMsg,
 			"Solved. Cov is " + std::to_string(ret)
@@ -637,4 +2567,5 @@ void MontageCore::SolveChannel(int channel_idx, int constraint, const cv::Mat& c
 		//fn += std::to_string(channel_idx) + ".png";
 		//imwrite(fn, output);
 	}
+	return true;
 }
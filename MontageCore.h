@@ -1,5 +1,7 @@
 #pragma once
 #include <vector>
+#include <functional>
+#include <atomic>
 #include "opencv2/opencv.hpp"
 
 class MontageCore
@@ -16,13 +18,66 @@ public:
 		My_Solver,
 		Eigen_Solver
 	};
+	enum class LabelMatchMode
+	{
+		Full_Resolution,
+		Coarse_To_Fine,
+		Tiled,
+		Block_Parallel,
+		Pairwise_Seams,
+		Superpixel
+	};
+	enum class GraphPrecision
+	{
+		Double,
+		Float,
+		Int32
+	};
+	// Tuning of Label Match, taken by the next RunLabelMatch or RunPreviewMatch
+	struct LabelMatchSettings
+	{
+		// memory allowed for the graphs and seam cost tables of Label Match, in bytes
+		double MemoryBudget = 2.0 * (1 << 30);
+		// pixels around changed strokes that are re-optimized
+		int IncrementalRadius = 24;
+		// pixels inside regions whose sources differ by less than this in every channel
+		// are not optimized, 0 (the default) optimizes every pixel
+		int AgreementTolerance = 0;
+		// data cost of an unstroked pixel per pixel of distance to the nearest stroke
+		// of its label, 0 disables inertia
+		double InertiaWeight = 0.0;
+		// Preview Label Match is solved on a level of at most PreviewMaxPixels pixels
+		// and stops after the first cycle that ends PreviewTimeBudget seconds after its start
+		double PreviewMaxPixels = 160 * 160;
+		double PreviewTimeBudget = 0.1;
+		// moves on a single graph are solved by the 4-connected grid maxflow of gco,
+		// which needs about a third of the memory of the general graph for dense moves
+		// but spans their bounding box; sparse moves still use the general graph
+		bool GridMaxflow = false;
+		// large moves are solved by the parallel maxflow of gco when Label Match runs on
+		// at least this many threads, below which it is slower than the serial one; 0 disables it
+		int ParallelMaxflowMinThreads = 8;
+	};
 private:
-	void BuildSolveMRF(const std::vector<cv::Mat>& Images, const cv::Mat& Label);
+	void BuildSolveMRF(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
+		const std::vector<cv::Mat>& Coverage);
+	cv::Mat SolveIncremental(const std::vector<cv::Mat>& Images, const cv::Mat& Label);
+	cv::Mat SolveMRF(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
+		const std::vector<cv::Mat>& Inertia, const std::vector<cv::Mat>& Coverage,
+		const cv::Mat& InitLabel, const cv::Mat& FreeMask);
+	cv::Mat SolveCoarse(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
+		double MaxPixels, int& Scale);
+	cv::Mat SolveCoarseToFine(const std::vector<cv::Mat>& Images, const cv::Mat& Label);
+	cv::Mat SolveTiled(const std::vector<cv::Mat>& Images, const cv::Mat& Label);
+	cv::Mat SolveBlockParallel(const std::vector<cv::Mat>& Images, const cv::Mat& Label);
+	cv::Mat SolvePairwiseSeams(const std::vector<cv::Mat>& Images, const cv::Mat& Label);
+	cv::Mat SolveSuperpixels(const std::vector<cv::Mat>& Images, const cv::Mat& Label);
 	void VisResultLabelMap(const cv::Mat& ResultLabel, int n_label);
 	void VisCompositeImage(const cv::Mat& ResultLabel, const std::vector<cv::Mat>& Images);
+	void EmitProgress(const cv::Mat& Labeling, const std::vector<cv::Mat>& Images);
 	void BuildSolveGradientFusion(const std::vector<cv::Mat>& Images, const cv::Mat& ResultLabel);
 
-	void SolveChannel(int channel_idx, int constraint, const cv::Mat& color_gradient_x, const cv::Mat& color_gradient_y, cv::Mat& output);
+	bool SolveChannel(int channel_idx, int constraint, const cv::Mat& color_gradient_x, const cv::Mat& color_gradient_y, cv::Mat& output);
 
 	void GradientAt(const cv::Mat& Image, int x, int y, cv::Vec3f& grad_x, cv::Vec3f& grad_y);
 
@@ -31,15 +86,48 @@ private:
 	cv::Mat* ResultLabel = nullptr;
 	cv::Mat* ResultImage = nullptr;
 	const std::vector<cv::Vec3b>* ImageColors = nullptr;;
+
+	// inertia planes of the strokes of current Label Match
+	std::vector<cv::Mat> InertiaPlanes;
+	// coverage masks of the sources of current Label Match, empty if they cover everything
+	std::vector<cv::Mat> CoverageMasks;
+	cv::Size CanvasSize;
+
+	std::function<void()> Progress;
+	const std::atomic<bool>* Cancel = nullptr;
+	bool IsCancelled() const;
+
+	LabelMatchSettings Settings;
 public:
+	// Label (CV_16SC1) holds the source index of each stroked pixel, undefined elsewhere,
+	// labelings are CV_16UC1, so up to 32767 sources can be matched.
+	// Coverage holds a CV_8UC1 mask per source, non-zero where the source has pixels
+	// (e.g. its alpha), or an empty Mat if it covers the canvas; it may be empty as a whole.
+	// A source can not be chosen outside its coverage, unless no source covers the pixel.
 	void RunLabelMatch(const std::vector<cv::Mat>& Images, const cv::Mat& Label,
-		double LargePenalty, double SmoothAlpha, SmoothTermType SmoothType);
+		double LargePenalty, double SmoothAlpha, SmoothTermType SmoothType,
+		LabelMatchMode Mode = LabelMatchMode::Full_Resolution,
+		GraphPrecision Precision = GraphPrecision::Double,
+		double TimeBudget = 0.0, double MinImprovement = 0.0,
+		const std::vector<cv::Mat>& Coverage = std::vector<cv::Mat>());
+	// Preview Label Match takes the sources, strokes and coverage already downsampled
+	// by Scale, which is CoarseScale of the canvas and Settings.PreviewMaxPixels
+	void RunPreviewMatch(const std::vector<cv::Mat>& Images, const cv::Mat& Label, int Scale,
+		double LargePenalty, double SmoothAlpha, SmoothTermType SmoothType,
+		const std::vector<cv::Mat>& Coverage = std::vector<cv::Mat>());
+	// Downsampling factor (a power of 2) of a level of a Width x Height canvas
+	// with at most MaxPixels pixels, the level is ceil(Width / Scale) x ceil(Height / Scale)
+	static int CoarseScale(int Width, int Height, double MaxPixels);
 	void RunGradientFusion(GradientFusionSolverType SolverType);
 	void BindResult(std::string* ResultMsg, cv::Mat* ResultLabel, cv::Mat* ResultImage);
 	void BindImageColors(const std::vector<cv::Vec3b>* ImageColors);
-private:
-	cv::flann::Index* AddInertiaConstraint(const cv::Mat& Label);
-public:
+	// Progress is called from the solving thread whenever an intermediate labeling
+	// of the whole canvas is shown in the bound result label and image
+	void BindProgress(const std::function<void()>& Progress);
+	// Once *Cancel becomes true, running Label Match or Gradient Fusion stops
+	// as soon as possible and leaves only "Interrupted." in the result message
+	void BindCancel(const std::atomic<bool>* Cancel);
+	void SetLabelMatchSettings(const LabelMatchSettings& Settings);
 	enum
 	{
 		undefined = -1
@@ -79,52 +79,35 @@ static QImage cvMat2QImage(const cv::Mat& mat)
 	}
 }
 
-void MontageLabelMatchWorker::run()
+// Usage:
+//   Coverage mask of <image>, 255 where its alpha is non-zero,
+//   empty if <image> has no alpha channel or is opaque everywhere
+static cv::Mat qImageCoverage(const QImage& image)
 {
-	using namespace std;
-	using namespace cv;
-
-	string stdMsg;
-	Mat rsltLbl, rsltImg;
-	MontageCore mc;
-	mc.BindResult(&stdMsg, &rsltLbl, &rsltImg);
-	mc.BindImageColors(&imageColors);
-	mc.RunLabelMatch(images, label, largePenalty, smoothAlpha, smoothType);
-	
-	MontageLabelMatchResult rslt = {
-		QString::fromStdString(stdMsg),
-		cvMat2QImage(rsltLbl),
-		cvMat2QImage(rsltImg),
-		this->colLabel
-	};
-	emit resultReady(rslt);
+	if (!image.hasAlphaChannel())
+		return cv::Mat();
+	QImage argb = image.convertToFormat(QImage::Format_ARGB32);
+	cv::Mat mat(argb.height(), argb.width(), CV_8UC4,
+		(void*)argb.constBits(), argb.bytesPerLine());
+	cv::Mat alpha;
+	cv::extractChannel(mat, alpha, 3); // ARGB32 is stored as B G R A
+	if (cv::countNonZero(alpha) == (int)alpha.total())
+		return cv::Mat();
+	return alpha > 0;
 }
 
-MontageLabelMatchWorker::MontageLabelMatchWorker(
-	const QVector<QImage>& images,
-	const QVector<QImage>& labels,
-	const QVector<QColor>& imageColors,
-	double largePenalty, double smoothAlpha, int smoothType
-	)
+// Usage:
+//   Convert <labels> painted white on black to <label> of source indices,
+//   <colLabel> of label colors and <cvColors> in BGR
+static void initLabelAndColors(
+	const QVector<QImage>& labels, const QVector<QColor>& imageColors,
+	int width, int height,
+	cv::Mat& label, QImage& colLabel, std::vector<cv::Vec3b>& cvColors)
 {
-	using namespace std;
 	using namespace cv;
-	// init images
-	for (auto img : images)
-	{
-		this->images.push_back(qImage2CvMat(img));
-	}
-	
-	// init label
-	int height, width;
-	label.create(
-		height = this->images[0].rows,
-		width = this->images[0].cols,
-		CV_8SC1
-	);
+	label.create(height, width, CV_16SC1);
 	label.setTo(MontageCore::undefined);
 
-	// init colLabel
 	colLabel = QImage(width, height, QImage::Format::Format_ARGB32);
 	colLabel.fill(QColor(0, 0, 0, 0));
 
@@ -140,8 +123,8 @@ MontageLabelMatchWorker::MontageLabelMatchWorker(
 				for (int x = 0; x < width; x++)
 					if (lbl.pixelColor(x, y) != Qt::GlobalColor::black)
 					{
-						this->label.at<uchar>(y, x) = srcImgIdx;
-						this->colLabel.setPixelColor(x, y, imageColors[srcImgIdx]);
+						label.at<short>(y, x) = srcImgIdx;
+						colLabel.setPixelColor(x, y, imageColors[srcImgIdx]);
 					}
 
 			break;
@@ -149,11 +132,10 @@ MontageLabelMatchWorker::MontageLabelMatchWorker(
 		srcImgIdx++;
 	}
 
-	// init imageColors
 	for (auto col : imageColors)
 	{
 		// here swap RGB 2 BGR
-		this->imageColors.push_back(
+		cvColors.push_back(
 			Vec3b(
 				col.blue(),
 				col.green(),
@@ -161,6 +143,113 @@ MontageLabelMatchWorker::MontageLabelMatchWorker(
 			)
 		);
 	}
+}
+
+// Usage:
+//   Same as initLabelAndColors, but <label> and <colLabel> are <width> x <height>
+//   and <labels> are downsampled into them, a pixel of <label> is stroked
+//   if any of the pixels it covers is
+static void initDownsampledLabelAndColors(
+	const QVector<QImage>& labels, const QVector<QColor>& imageColors,
+	int width, int height,
+	cv::Mat& label, QImage& colLabel, std::vector<cv::Vec3b>& cvColors)
+{
+	using namespace cv;
+	label.create(height, width, CV_16SC1);
+	label.setTo(MontageCore::undefined);
+
+	for (int srcImgIdx = 0; srcImgIdx < labels.size(); srcImgIdx++)
+	{
+		if (labels[srcImgIdx].isNull())
+			continue;
+		// scan lines are read directly, pixelColor is too slow for full resolution strokes
+		QImage gray = labels[srcImgIdx].convertToFormat(QImage::Format_Grayscale8);
+		for (int y = 0; y < gray.height(); y++)
+		{
+			const uchar* src = gray.constScanLine(y);
+			short* dst = label.ptr<short>(y * height / gray.height());
+			for (int x = 0; x < gray.width(); x++)
+				if (src[x] != 0)
+					dst[x * width / gray.width()] = srcImgIdx;
+		}
+	}
+
+	colLabel = QImage(width, height, QImage::Format::Format_ARGB32);
+	colLabel.fill(QColor(0, 0, 0, 0));
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			if (label.at<short>(y, x) != MontageCore::undefined)
+				colLabel.setPixelColor(x, y, imageColors[label.at<short>(y, x)]);
+
+	for (auto col : imageColors)
+	{
+		// here swap RGB 2 BGR
+		cvColors.push_back(Vec3b(col.blue(), col.green(), col.red()));
+	}
+}
+
+void MontageLabelMatchWorker::run()
+{
+	using namespace std;
+	using namespace cv;
+
+	string stdMsg;
+	Mat rsltLbl, rsltImg;
+	MontageCore mc;
+	mc.BindResult(&stdMsg, &rsltLbl, &rsltImg);
+	mc.BindImageColors(&imageColors);
+	mc.BindProgress([&]()
+		{
+			MontageLabelMatchResult progress = {
+				QString(),
+				cvMat2QImage(rsltLbl),
+				cvMat2QImage(rsltImg),
+				this->colLabel
+			};
+			emit progressReady(progress);
+		});
+	mc.BindCancel(&cancelled);
+	mc.SetLabelMatchSettings(settings);
+	mc.RunLabelMatch(images, label, largePenalty, smoothAlpha, smoothType, labelMatchMode,
+		graphPrecision, timeBudget, minImprovement, coverage);
+	
+	MontageLabelMatchResult rslt = {
+		QString::fromStdString(stdMsg),
+		cvMat2QImage(rsltLbl),
+		cvMat2QImage(rsltImg),
+		this->colLabel
+	};
+	emit resultReady(rslt);
+}
+
+void MontageLabelMatchWorker::cancel()
+{
+	cancelled = true;
+}
+
+MontageLabelMatchWorker::MontageLabelMatchWorker(
+	const QVector<QImage>& images,
+	const QVector<QImage>& labels,
+	const QVector<QColor>& imageColors,
+	double largePenalty, double smoothAlpha, int smoothType,
+	int labelMatchMode, int graphPrecision,
+	double timeBudget, double minImprovement,
+	const MontageCore::LabelMatchSettings& settings
+	)
+	: settings(settings)
+{
+	using namespace std;
+	using namespace cv;
+	// init images, alpha is read before qImage2CvMat discards it
+	for (auto img : images)
+	{
+		this->coverage.push_back(qImageCoverage(img));
+		this->images.push_back(qImage2CvMat(img));
+	}
+	
+	// init label, colLabel and imageColors
+	initLabelAndColors(labels, imageColors, this->images[0].cols, this->images[0].rows,
+		this->label, this->colLabel, this->imageColors);
 
 	// init config
 	this->largePenalty = largePenalty;
@@ -178,6 +267,119 @@ MontageLabelMatchWorker::MontageLabelMatchWorker(
 		this->smoothType = MontageCore::SmoothTermType::X_Divide_By_Z;
 		break;
 	}
+	switch (labelMatchMode)
+	{
+	case 1:
+		this->labelMatchMode = MontageCore::LabelMatchMode::Coarse_To_Fine;
+		break;
+	case 2:
+		this->labelMatchMode = MontageCore::LabelMatchMode::Tiled;
+		break;
+	case 3:
+		this->labelMatchMode = MontageCore::LabelMatchMode::Block_Parallel;
+		break;
+	case 4:
+		this->labelMatchMode = MontageCore::LabelMatchMode::Pairwise_Seams;
+		break;
+	case 5:
+		this->labelMatchMode = MontageCore::LabelMatchMode::Superpixel;
+		break;
+	case 0:
+	default:
+		this->labelMatchMode = MontageCore::LabelMatchMode::Full_Resolution;
+		break;
+	}
+	switch (graphPrecision)
+	{
+	case 1:
+		this->graphPrecision = MontageCore::GraphPrecision::Float;
+		break;
+	case 2:
+		this->graphPrecision = MontageCore::GraphPrecision::Int32;
+		break;
+	case 0:
+	default:
+		this->graphPrecision = MontageCore::GraphPrecision::Double;
+		break;
+	}
+	this->timeBudget = timeBudget;
+	this->minImprovement = minImprovement;
+}
+
+void MontagePreviewWorker::run()
+{
+	using namespace std;
+	using namespace cv;
+
+	// conversions are done here to keep painting smooth,
+	// the sources are small, the strokes are downsampled as they are converted
+	vector<Mat> cvImages, coverage;
+	for (auto img : images)
+	{
+		if (cancelled)
+			return;
+		coverage.push_back(qImageCoverage(img));
+		cvImages.push_back(qImage2CvMat(img));
+	}
+	Mat label;
+	QImage colLabel;
+	vector<Vec3b> cvColors;
+	initDownsampledLabelAndColors(labels, imageColors, cvImages[0].cols, cvImages[0].rows,
+		label, colLabel, cvColors);
+	if (cancelled)
+		return;
+
+	Mat rsltLbl, rsltImg;
+	MontageCore mc;
+	mc.BindResult(nullptr, &rsltLbl, &rsltImg);
+	mc.BindImageColors(&cvColors);
+	mc.BindCancel(&cancelled);
+	mc.SetLabelMatchSettings(settings);
+	mc.RunPreviewMatch(cvImages, label, scale, largePenalty, smoothAlpha, smoothType, coverage);
+	if (cancelled || rsltImg.empty())
+		return;
+
+	// shown in place of a full resolution result
+	QSize canvas(width, height);
+	MontageLabelMatchResult rslt = {
+		QString(),
+		cvMat2QImage(rsltLbl).scaled(canvas),
+		cvMat2QImage(rsltImg).scaled(canvas),
+		colLabel.scaled(canvas)
+	};
+	emit resultReady(rslt);
+}
+
+void MontagePreviewWorker::cancel()
+{
+	cancelled = true;
+}
+
+MontagePreviewWorker::MontagePreviewWorker(
+	const QVector<QImage>& images,
+	const QVector<QImage>& labels,
+	const QVector<QColor>& imageColors,
+	int scale, int width, int height,
+	double largePenalty, double smoothAlpha, int smoothType,
+	const MontageCore::LabelMatchSettings& settings
+	)
+	: images(images), labels(labels), imageColors(imageColors),
+	scale(scale), width(width), height(height),
+	largePenalty(largePenalty), smoothAlpha(smoothAlpha), settings(settings)
+{
+	switch (smoothType)
+	{
+	case 0:
+		this->smoothType = MontageCore::SmoothTermType::X;
+		break;
+	case 1:
+		this->smoothType = MontageCore::SmoothTermType::X_Plus_Y;
+		break;
+	case 2:
+	default:
+		this->smoothType = MontageCore::SmoothTermType::X_Divide_By_Z;
+		break;
+	}
 }
 
 void MontageGradientFusionWorker::run()
@@ -189,6 +391,7 @@ void MontageGradientFusionWorker::run()
 	Mat rsltImg;
 	MontageCore mc;
 	mc.BindResult(&stdMsg, nullptr, &rsltImg);
+	mc.BindCancel(&cancelled);
 	mc.RunGradientFusion(solverType);
 	
 	MontageGradientFusionResult rslt =
@@ -200,6 +403,11 @@ void MontageGradientFusionWorker::run()
 	emit resultReady(rslt);
 }
 
+void MontageGradientFusionWorker::cancel()
+{
+	cancelled = true;
+}
+
 MontageGradientFusionWorker::MontageGradientFusionWorker(int solverType)
 {
 	switch (solverType)
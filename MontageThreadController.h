@@ -5,6 +5,7 @@
 #include <QImage>
 
 #include <vector>
+#include <atomic>
 
 #include <opencv2/opencv.hpp>
 
@@ -25,24 +26,75 @@ class MontageLabelMatchWorker:
     Q_OBJECT
 private:
     std::vector<cv::Mat> images;
+    // coverage masks from the alpha of images, see MontageCore::RunLabelMatch
+    std::vector<cv::Mat> coverage;
     cv::Mat label;
     std::vector<cv::Vec3b> imageColors;
     double largePenalty;
     double smoothAlpha;
     MontageCore::SmoothTermType smoothType;
+    MontageCore::LabelMatchMode labelMatchMode;
+    MontageCore::GraphPrecision graphPrecision;
+    double timeBudget;
+    double minImprovement;
+    MontageCore::LabelMatchSettings settings;
     // The colored label buffered for current Labeling process.
     // We need this since designatedLbls may change during Labeling.
     QImage colLabel;
+    std::atomic<bool> cancelled{ false };
 public:
     void run() override;
+    // Asks run() to stop, safe to be called from any thread
+    void cancel();
     MontageLabelMatchWorker(
         const QVector<QImage>& images,
         const QVector<QImage>& labels,
         const QVector<QColor>& imagesColors,
-        double largePenalty, double smoothAlpha, int smoothType
+        double largePenalty, double smoothAlpha, int smoothType,
+        int labelMatchMode, int graphPrecision,
+        double timeBudget, double minImprovement,
+        const MontageCore::LabelMatchSettings& settings
     );
 
 signals:
+    // intermediate labelings of an anytime Label Match, msg is empty
+    void progressReady(const MontageLabelMatchResult& result);
+    void resultReady(const MontageLabelMatchResult& result);
+};
+
+// Runs a low resolution Label Match for previewing strokes.
+// It copies the QImages only, which are implicitly shared, and converts them in run().
+// The sources are given downsampled by scale, the strokes at the full width x height,
+// results are scaled back to width x height.
+class MontagePreviewWorker :
+    public QThread
+{
+    Q_OBJECT
+private:
+    QVector<QImage> images;
+    QVector<QImage> labels;
+    QVector<QColor> imageColors;
+    int scale;
+    int width, height;
+    double largePenalty;
+    double smoothAlpha;
+    MontageCore::SmoothTermType smoothType;
+    MontageCore::LabelMatchSettings settings;
+    std::atomic<bool> cancelled{ false };
+public:
+    void run() override;
+    // Asks run() to stop, safe to be called from any thread
+    void cancel();
+    MontagePreviewWorker(
+        const QVector<QImage>& images,
+        const QVector<QImage>& labels,
+        const QVector<QColor>& imagesColors,
+        int scale, int width, int height,
+        double largePenalty, double smoothAlpha, int smoothType,
+        const MontageCore::LabelMatchSettings& settings
+    );
+signals:
+    // not emitted if the preview is cancelled, msg is empty
     void resultReady(const MontageLabelMatchResult& result);
 };
 
@@ -59,8 +111,11 @@ class MontageGradientFusionWorker :
     Q_OBJECT
 private:
     MontageCore::GradientFusionSolverType solverType;
+    std::atomic<bool> cancelled{ false };
 public:
     void run() override;
+    // Asks run() to stop, safe to be called from any thread
+    void cancel();
     MontageGradientFusionWorker(int solverType);
 signals:
     void resultReady(const MontageGradientFusionResult& result);
@@ -6,6 +6,7 @@
 #include <map>
 #include <unordered_set>
 #include <algorithm>
+#include <atomic>
 
 namespace Kouek
 {
@@ -53,10 +54,12 @@ namespace Kouek
 			std::vector<double>& x,
 			const std::vector<double>& b,
 			double sigma = 0.05, int maxStep = 1000);
+		// returns false without finishing if *cancel becomes true
 		static bool solveInConjugateGradient(const SparseMat<T>& A,
 			std::vector<double>& x,
 			const std::vector<double>& b,
-			double sigma = 0.05, int maxStep = 1000);
+			double sigma = 0.05, int maxStep = 1000,
+			const std::atomic<bool>* cancel = nullptr);
 		// operator
 		SparseMat<T>& operator=(const SparseMat<T>& right);
 		bool multiply(std::vector<T>& result, const std::vector<T>& mult) const;
@@ -160,7 +163,8 @@ namespace Kouek
 		this->NZElemNum = right.NZElemNum;
 		this->valid = right.valid;
 		this->ref = right.ref;
-		(*this->ref)++;
+		if (this->ref != nullptr) // an empty mat owns nothing
+			(*this->ref)++;
 
 		this->datOfIdx = right.datOfIdx;
 		this->fstIdxOfRow = right.fstIdxOfRow;
@@ -378,7 +382,7 @@ namespace Kouek
 	}
 
 	template<typename T>
-	inline bool SparseMat<T>::solveInConjugateGradient(const SparseMat<T>& A, std::vector<double>& x, const std::vector<double>& b, double sigma, int maxStep)
+	inline bool SparseMat<T>::solveInConjugateGradient(const SparseMat<T>& A, std::vector<double>& x, const std::vector<double>& b, double sigma, int maxStep, const std::atomic<bool>* cancel)
 	{
 		if (A.getCols() != A.getRows()) // must be square mat
 			return false;
@@ -400,6 +404,8 @@ namespace Kouek
 		std::vector<double> Ap(x.size()), p(x.size());
 		for (int step = 0; step < maxStep; step++)
 		{
+			if (cancel != nullptr && cancel->load())
+				return false;
 			r0r0 = vecMultiplyVec(r0, r0);
 			A.multiply(Ap, p0);
 			a = r0r0 / vecMultiplyVec(p0, Ap);
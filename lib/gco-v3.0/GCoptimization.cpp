@@ -5,6 +5,7 @@
 #include "LinkedBlockList.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <vector>
 #include <algorithm>
 
@@ -82,6 +83,204 @@ void GCException::Report()
 
 
 
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//   Graph of one move, with selectable precision and maxflow
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+GCoptimization::MoveEnergy::MoveEnergy(GraphPrecision precision, bool grid, EnergyTermType scale, int var_num_max, int edge_num_max, void (*err_function)(const char *))
+: m_double(0)
+, m_float(0)
+, m_int32(0)
+, m_gridDouble(0)
+, m_gridFloat(0)
+, m_gridInt32(0)
+, m_precision(precision)
+, m_scale(precision == GraphInt32 ? scale : 1)
+, m_keepEnergy(0)
+{
+	switch ( m_precision )
+	{
+	case GraphFloat: if ( grid ) m_gridFloat  = new GridFloatT(err_function);  else m_float  = new FloatT(var_num_max,edge_num_max,err_function);  break;
+	case GraphInt32: if ( grid ) m_gridInt32  = new GridInt32T(err_function);  else m_int32  = new Int32T(var_num_max,edge_num_max,err_function);  break;
+	default:         if ( grid ) m_gridDouble = new GridDoubleT(err_function); else m_double = new DoubleT(var_num_max,edge_num_max,err_function); break;
+	}
+}
+
+GCoptimization::MoveEnergy::~MoveEnergy()
+{
+	delete m_double;
+	delete m_float;
+	delete m_int32;
+	delete m_gridDouble;
+	delete m_gridFloat;
+	delete m_gridInt32;
+}
+
+void GCoptimization::MoveEnergy::reset(EnergyTermType scale, int var_num_max, int edge_num_max)
+{
+	m_scale = m_precision == GraphInt32 ? scale : 1;
+	m_keepEnergy = 0;
+	if ( grid() )
+		return; // see set_grid_sites
+	switch ( m_precision )
+	{
+	case GraphFloat: m_float->reset();  m_float->reserve(var_num_max,edge_num_max);  break;
+	case GraphInt32: m_int32->reset();  m_int32->reserve(var_num_max,edge_num_max);  break;
+	default:         m_double->reset(); m_double->reserve(var_num_max,edge_num_max); break;
+	}
+}
+
+void GCoptimization::MoveEnergy::set_grid_sites(const SiteID* sites, SiteID count, SiteID width, int threads)
+{
+	switch ( m_precision )
+	{
+	case GraphFloat: m_gridFloat->reset(sites,count,width);  m_gridFloat->set_threads(threads);  break;
+	case GraphInt32: m_gridInt32->reset(sites,count,width);  m_gridInt32->set_threads(threads);  break;
+	default:         m_gridDouble->reset(sites,count,width); m_gridDouble->set_threads(threads); break;
+	}
+}
+
+int GCoptimization::MoveEnergy::quantize(EnergyTermType v) const
+{
+	EnergyTermType q = floor(v*m_scale + 0.5);
+	if ( q > GCO_MAX_GRAPHTERM_INT32 )  return GCO_MAX_GRAPHTERM_INT32;
+	if ( q < -GCO_MAX_GRAPHTERM_INT32 ) return -GCO_MAX_GRAPHTERM_INT32;
+	return (int)q;
+}
+
+GCoptimization::EnergyTermType GCoptimization::MoveEnergy::stored(EnergyTermType v) const
+{
+	switch ( m_precision )
+	{
+	case GraphFloat: return (float)v;
+	case GraphInt32: return quantize(v)/m_scale;
+	default:         return v;
+	}
+}
+
+GCoptimization::MoveEnergy::Var GCoptimization::MoveEnergy::add_variable(int num)
+{
+	switch ( m_precision )
+	{
+	case GraphFloat: return m_gridFloat  ? m_gridFloat->add_variable(num)  : m_float->add_variable(num);
+	case GraphInt32: return m_gridInt32  ? m_gridInt32->add_variable(num)  : m_int32->add_variable(num);
+	default:         return m_gridDouble ? m_gridDouble->add_variable(num) : m_double->add_variable(num);
+	}
+}
+
+void GCoptimization::MoveEnergy::add_term1(Var x, EnergyTermType E0, EnergyTermType E1)
+{
+	switch ( m_precision )
+	{
+	case GraphFloat:
+		if ( m_gridFloat ) m_gridFloat->add_term1(x,(float)E0,(float)E1);
+		else               m_float->add_term1(x,(float)E0,(float)E1);
+		break;
+	case GraphInt32:
+		if ( m_gridInt32 ) m_gridInt32->add_term1(x,quantize(E0),quantize(E1));
+		else               m_int32->add_term1(x,quantize(E0),quantize(E1));
+		break;
+	default:
+		if ( m_gridDouble ) m_gridDouble->add_term1(x,E0,E1);
+		else                m_double->add_term1(x,E0,E1);
+		break;
+	}
+}
+
+// Same decomposition as Energy::add_term2, but a term that is submodular in cost units
+// may lose it by rounding, so its edge capacity is clamped to 0 instead of going negative.
+template <typename G, typename T>
+void GCoptimization::MoveEnergy::addTerm2(G* g, Var x, Var y, T A, T B, T C, T D)
+{
+	g->add_tweights(x,D,A);
+	B -= A; C -= D;
+	T BC = B + C;
+	if ( BC < 0 ) BC = 0;
+	if ( B < 0 )
+	{
+		g->add_tweights(x,0,B);
+		g->add_tweights(y,0,-B);
+		g->add_edge(x,y,0,BC);
+	}
+	else if ( C < 0 )
+	{
+		g->add_tweights(x,0,-C);
+		g->add_tweights(y,0,C);
+		g->add_edge(x,y,BC,0);
+	}
+	else
+		g->add_edge(x,y,B,C);
+}
+
+void GCoptimization::MoveEnergy::add_term2(Var x, Var y, EnergyTermType E00, EnergyTermType E01, EnergyTermType E10, EnergyTermType E11)
+{
+	switch ( m_precision )
+	{
+	case GraphFloat:
+		if ( m_gridFloat ) addTerm2<GridFloatT,float>(m_gridFloat,x,y,(float)E00,(float)E01,(float)E10,(float)E11);
+		else               addTerm2<FloatT,float>(m_float,x,y,(float)E00,(float)E01,(float)E10,(float)E11);
+		break;
+	case GraphInt32:
+		if ( m_gridInt32 ) addTerm2<GridInt32T,int>(m_gridInt32,x,y,quantize(E00),quantize(E01),quantize(E10),quantize(E11));
+		else               addTerm2<Int32T,int>(m_int32,x,y,quantize(E00),quantize(E01),quantize(E10),quantize(E11));
+		break;
+	default:
+		if ( m_gridDouble ) m_gridDouble->add_term2(x,y,E00,E01,E10,E11);
+		else                m_double->add_term2(x,y,E00,E01,E10,E11);
+		break;
+	}
+}
+
+GCoptimization::EnergyType GCoptimization::MoveEnergy::minimize()
+{
+	switch ( m_precision )
+	{
+	case GraphFloat: return (EnergyType)(m_gridFloat ? m_gridFloat->minimize() : m_float->minimize());
+	case GraphInt32: return (EnergyType)(m_gridInt32 ? m_gridInt32->minimize() : m_int32->minimize())/m_scale;
+	default:         return m_gridDouble ? m_gridDouble->minimize() : m_double->minimize();
+	}
+}
+
+int GCoptimization::MoveEnergy::get_var(Var x)
+{
+	switch ( m_precision )
+	{
+	case GraphFloat: return m_gridFloat  ? m_gridFloat->get_var(x)  : m_float->get_var(x);
+	case GraphInt32: return m_gridInt32  ? m_gridInt32->get_var(x)  : m_int32->get_var(x);
+	default:         return m_gridDouble ? m_gridDouble->get_var(x) : m_double->get_var(x);
+	}
+}
+
+int GCoptimization::MoveEnergy::get_node_num()
+{
+	switch ( m_precision )
+	{
+	case GraphFloat: return m_gridFloat  ? m_gridFloat->get_node_num()  : m_float->get_node_num();
+	case GraphInt32: return m_gridInt32  ? m_gridInt32->get_node_num()  : m_int32->get_node_num();
+	default:         return m_gridDouble ? m_gridDouble->get_node_num() : m_double->get_node_num();
+	}
+}
+
+void GCoptimization::MoveEnergy::set_interrupt(const std::atomic<bool>* flag)
+{
+	switch ( m_precision )
+	{
+	case GraphFloat: if ( m_gridFloat )  m_gridFloat->set_interrupt(flag);  else m_float->set_interrupt(flag);  break;
+	case GraphInt32: if ( m_gridInt32 )  m_gridInt32->set_interrupt(flag);  else m_int32->set_interrupt(flag);  break;
+	default:         if ( m_gridDouble ) m_gridDouble->set_interrupt(flag); else m_double->set_interrupt(flag); break;
+	}
+}
+
+int GCoptimization::MoveEnergy::get_arc_num()
+{
+	switch ( m_precision )
+	{
+	case GraphFloat: return m_gridFloat  ? 2*m_gridFloat->get_edge_num()  : m_float->get_arc_num();
+	case GraphInt32: return m_gridInt32  ? 2*m_gridInt32->get_edge_num()  : m_int32->get_arc_num();
+	default:         return m_gridDouble ? 2*m_gridDouble->get_edge_num() : m_double->get_arc_num();
+	}
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //   First we have functions for the base class
 /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -119,6 +318,17 @@ GCoptimization::GCoptimization(SiteID nSites, LabelID nLabels)
 , m_activeLabelCounts(new SiteID[m_num_labels])
 , m_stepsThisCycle(0)
 , m_stepsThisCycleTotal(0)
+, m_numThreads(1)
+, m_freeSites(0)
+, m_freeSitesCount(0)
+, m_graphReuse(false)
+, m_parallelSwaps(false)
+, m_graphPrecision(GraphDouble)
+, m_graphScale(1)
+, m_interruptFlag(0)
+, m_gridMaxflow(false)
+, m_parallelMaxflow(false)
+, m_graphPool(&m_ownGraphPool)
 {
 	if ( nLabels <= 1 ) handleError("Number of labels must be >= 2");
 	if ( nSites <= 0 )  handleError("Number of sites must be >= 1");
@@ -154,6 +364,8 @@ GCoptimization::~GCoptimization()
 
 	if (m_datacostIndividual) delete [] m_datacostIndividual;
 	if (m_smoothcostIndividual) delete [] m_smoothcostIndividual;
+	if (m_freeSites) delete [] m_freeSites;
+	clearReusedGraphs();
 
 	// Delete label cost bookkeeping structures
 	//
@@ -173,6 +385,183 @@ GCoptimization::SiteID GCoptimization::queryActiveSitesExpansion<GCoptimization:
 	return ((DataCostFnSparse*)m_datacostFn)->queryActiveSitesExpansion(alpha_label,m_labeling,activeSites);
 }
 
+//-------------------------------------------------------------------
+// Active sites among the free ones only; for sparse data costs a free site
+// must also be feasible for alpha, as in DataCostFnSparse::queryActiveSitesExpansion.
+
+GCoptimization::SiteID GCoptimization::queryFreeSitesExpansion(LabelID alpha_label,SiteID *activeSites)
+{
+	DataCostFnSparse* sparse = 0;
+	if ( m_queryActiveSitesExpansion == (SiteID (GCoptimization::*)(LabelID,SiteID*))&GCoptimization::queryActiveSitesExpansion<DataCostFnSparse> )
+		sparse = (DataCostFnSparse*)m_datacostFn;
+
+	SiteID size = 0;
+	for ( SiteID i = 0; i < m_freeSitesCount; i++ )
+	{
+		SiteID site = m_freeSites[i];
+		if ( m_labeling[site] == alpha_label )
+			continue;
+		if ( sparse && sparse->getDefault() >= GCO_MAX_ENERGYTERM && sparse->compute(site,alpha_label) >= GCO_MAX_ENERGYTERM )
+			continue;
+		activeSites[size++] = site;
+	}
+	return size;
+}
+
+//-------------------------------------------------------------------
+// With setGraphReuse every move is built over all sites that may move, so that
+// the same move always yields a graph of the same shape.
+
+GCoptimization::SiteID GCoptimization::queryMovableSites(SiteID *activeSites)
+{
+	if ( m_freeSites )
+	{
+		memcpy(activeSites,m_freeSites,m_freeSitesCount*sizeof(SiteID));
+		return m_freeSitesCount;
+	}
+	for ( SiteID i = 0; i < m_num_sites; i++ )
+		activeSites[i] = i;
+	return m_num_sites;
+}
+
+//-------------------------------------------------------------------
+// Solves freshly built graph e of the move 'key'. The first time, e itself is kept.
+// Later, e only tells the new capacities: the kept graph is updated to them as in
+// Kohli & Torr, "Dynamic Graph Cuts" (flow exceeding a lowered arc capacity is sent
+// back through the t-links of its ends), changed nodes are marked, e is deleted and
+// maxflow continues with the previous search trees.
+// Returns the kept graph; gain (optional) receives the energy of its cut minus the
+// energy of putting every variable in SINK, i.e. of choosing 1 everywhere.
+
+template <typename G>
+GCoptimization::EnergyType GCoptimization::reuseGraph(ReusedGraph& g, G* kept, G* fresh, bool wantGain)
+{
+	typedef typename G::Value T;
+	SiteID numVars = (SiteID)g.trcap.size();
+	int numArcs = (int)g.rcap.size();
+
+	if ( !fresh )
+	{
+		for ( SiteID i = 0; i < numVars; i++ )
+			g.trcap[i] = kept->get_trcap(i);
+		typename G::arc_id a = kept->get_first_arc();
+		for ( int k = 0; k < numArcs; k++, a = kept->get_next_arc(a) )
+			g.rcap[k] = kept->get_rcap(a);
+		kept->maxflow();
+	}
+	else
+	{
+		for ( SiteID i = 0; i < numVars; i++ )
+		{
+			T t = fresh->get_trcap(i);
+			if ( t != (T)g.trcap[i] )
+			{
+				kept->set_trcap(i,kept->get_trcap(i) + t - (T)g.trcap[i]);
+				g.trcap[i] = t;
+				kept->mark_node(i);
+			}
+		}
+		typename G::arc_id a = fresh->get_first_arc();
+		typename G::arc_id ka = kept->get_first_arc();
+		for ( int k = 0; k < numArcs; k += 2 )
+		{
+			typename G::arc_id a_rev = fresh->get_next_arc(a);
+			typename G::arc_id ka_rev = kept->get_next_arc(ka);
+			T cap = fresh->get_rcap(a), rev_cap = fresh->get_rcap(a_rev);
+			if ( cap != (T)g.rcap[k] || rev_cap != (T)g.rcap[k+1] )
+			{
+				VarID i,j;
+				kept->get_arc_ends(ka,i,j);
+				T flow = (T)g.rcap[k] - kept->get_rcap(ka); // i->j
+				T moved = std::min(std::max(flow,(T)-rev_cap),cap);
+				kept->set_rcap(ka,cap - moved);
+				kept->set_rcap(ka_rev,rev_cap + moved);
+				kept->set_trcap(i,kept->get_trcap(i) + flow - moved);
+				kept->set_trcap(j,kept->get_trcap(j) - flow + moved);
+				g.rcap[k] = cap;
+				g.rcap[k+1] = rev_cap;
+				kept->mark_node(i);
+				kept->mark_node(j);
+			}
+			a = fresh->get_next_arc(a_rev);
+			ka = kept->get_next_arc(ka_rev);
+		}
+		kept->maxflow(true);
+	}
+
+	EnergyType gain = 0;
+	if ( wantGain )
+	{
+		for ( SiteID i = 0; i < numVars; i++ )
+			if ( kept->get_var(i) == 0 )
+				gain -= g.trcap[i];
+		typename G::arc_id a = kept->get_first_arc();
+		for ( int k = 0; k < numArcs; k++, a = kept->get_next_arc(a) )
+		{
+			VarID i,j;
+			kept->get_arc_ends(a,i,j);
+			if ( kept->get_var(i) == 0 && kept->get_var(j) == 1 )
+				gain += g.rcap[k];
+		}
+	}
+	return gain;
+}
+
+GCoptimization::EnergyT* GCoptimization::solveReused(size_t key, EnergyT* e, EnergyType* gain)
+{
+	if ( m_reusedGraphs.size() <= key )
+		m_reusedGraphs.resize(key+1,0);
+	ReusedGraph*& g = m_reusedGraphs[key];
+
+	SiteID numVars = (SiteID)e->get_node_num();
+	int numArcs = e->get_arc_num();
+	if ( g && ((SiteID)g->trcap.size() != numVars || (int)g->rcap.size() != numArcs
+	           || g->e->precision() != e->precision()) )
+	{
+		releaseMoveEnergy(g->e); // shape of the move changed, start over
+		g->e = 0;
+		delete g;
+		g = 0;
+	}
+
+	EnergyT* fresh = e;
+	if ( !g )
+	{
+		g = new ReusedGraph;
+		g->e = e;
+		g->trcap.resize(numVars);
+		g->rcap.resize(numArcs);
+		fresh = 0;
+	}
+
+	EnergyT* r = g->e;
+	EnergyType cutGain;
+	switch ( r->precision() )
+	{
+	case GraphFloat: cutGain = reuseGraph(*g,r->m_float,fresh ? fresh->m_float : 0,gain != 0); break;
+	case GraphInt32: cutGain = reuseGraph(*g,r->m_int32,fresh ? fresh->m_int32 : 0,gain != 0); break;
+	default:         cutGain = reuseGraph(*g,r->m_double,fresh ? fresh->m_double : 0,gain != 0); break;
+	}
+	releaseMoveEnergy(fresh);
+	if ( gain )
+		*gain = r->unscale(cutGain);
+	return r;
+}
+
+//-------------------------------------------------------------------
+
+void GCoptimization::clearReusedGraphs()
+{
+	for ( size_t k = 0; k < m_reusedGraphs.size(); k++ )
+		if ( m_reusedGraphs[k] )
+		{
+			releaseMoveEnergy(m_reusedGraphs[k]->e);
+			m_reusedGraphs[k]->e = 0;
+			delete m_reusedGraphs[k];
+		}
+	m_reusedGraphs.clear();
+}
+
 //-------------------------------------------------------------------
 
 template <>
@@ -180,12 +569,14 @@ void GCoptimization::setupDataCostsExpansion<GCoptimization::DataCostFnSparse>(S
 {
 	DataCostFnSparse* dc = (DataCostFnSparse*)m_datacostFn;
 	DataCostFnSparse::iterator dciter = dc->begin(alpha_label);
+	DataCostFnSparse::iterator dcend  = dc->end(alpha_label);
 	for ( SiteID i = 0; i < size; ++i )
 	{
 		SiteID site = activeSites[i];
-		while ( dciter.site() != site )
+		while ( dciter != dcend && dciter.site() < site )
 			++dciter;
-		addterm1_checked(e,i,dciter.cost(),m_labelingDataCosts[site]);
+		EnergyTermType cost = (dciter != dcend && dciter.site() == site) ? dciter.cost() : dc->getDefault();
+		addterm1_checked(e,i,cost,m_labelingDataCosts[site]);
 	}
 }
 
@@ -196,6 +587,7 @@ void GCoptimization::applyNewLabeling<GCoptimization::DataCostFnSparse>(EnergyT
 {
 	DataCostFnSparse* dc = (DataCostFnSparse*)m_datacostFn;
 	DataCostFnSparse::iterator dciter = dc->begin(alpha_label);
+	DataCostFnSparse::iterator dcend  = dc->end(alpha_label);
 	for ( SiteID i = 0; i < size; i++ )
 	{
 		if ( e->get_var(i) == 0 )
@@ -205,15 +597,68 @@ void GCoptimization::applyNewLabeling<GCoptimization::DataCostFnSparse>(EnergyT
 			m_labeling[site] = alpha_label;
 			m_labelCounts[alpha_label]++;
 			m_labelCounts[prev]--;
-			while ( dciter.site() != site )
+			while ( dciter != dcend && dciter.site() < site )
 				++dciter;
-			m_labelingDataCosts[site] = dciter.cost();
+			m_labelingDataCosts[site] = (dciter != dcend && dciter.site() == site) ? dciter.cost() : dc->getDefault();
 		}
 	}
 	m_labelingInfoDirty = true;
 	updateLabelingInfo(false,true,false); // labels have changed, so update necessary labeling info
 }
 
+//-------------------------------------------------------------------
+// Lookups move the search hint of their bucket, so instead of querying every site
+// each label's list is walked by one thread; sites of different labels are disjoint.
+
+template <>
+void GCoptimization::updateLabelingDataCosts<GCoptimization::DataCostFnSparse>()
+{
+	DataCostFnSparse* dc = (DataCostFnSparse*)m_datacostFn;
+	EnergyTermType cost = dc->getDefault();
+	for ( SiteID i = 0; i < m_num_sites; ++i )
+		m_labelingDataCosts[i] = cost;
+#pragma omp parallel for num_threads(m_numThreads) schedule(dynamic) if(m_numThreads > 1)
+	for ( LabelID l = 0; l < m_num_labels; ++l )
+	{
+		DataCostFnSparse::iterator dcend = dc->end(l);
+		for ( DataCostFnSparse::iterator dciter = dc->begin(l); dciter != dcend; ++dciter )
+			if ( m_labeling[dciter.site()] == l )
+				m_labelingDataCosts[dciter.site()] = dciter.cost();
+	}
+}
+
+//-------------------------------------------------------------------
+// Data costs that may be queried from several threads at once, for any label.
+
+template <typename DataCostT>
+bool GCoptimization::concurrentDataCosts() const
+{
+	return true;
+}
+
+template <>
+bool GCoptimization::concurrentDataCosts<GCoptimization::DataCostFnSparse>() const
+{
+	return false;
+}
+
+template <>
+bool GCoptimization::concurrentDataCosts<GCoptimization::DataCostFunctor>() const
+{
+	return ((DataCostFunctor*)m_datacostFn)->threadSafe();
+}
+
+//-------------------------------------------------------------------
+// Data costs that concurrent swaps of disjoint label pairs may query;
+// sparse costs keep a search hint per label, so they can.
+
+bool GCoptimization::concurrentSwapDataCosts() const
+{
+	if ( m_setupDataCostsSwap == &GCoptimization::setupDataCostsSwap<DataCostFunctor> )
+		return concurrentDataCosts<DataCostFunctor>();
+	return true;
+}
+
 //-------------------------------------------------------------------
 
 template <typename UserFunctor>
@@ -257,11 +702,12 @@ template <typename SmoothCostT>
 GCoptimization::EnergyType GCoptimization::giveSmoothEnergyInternal()
 {
 	EnergyType eng = (EnergyType) 0;
-	SiteID i,numN,*nPointer,nSite,n;
-	EnergyTermType *weights;
 	SmoothCostT* sc = (SmoothCostT*) m_smoothcostFn;
-	for ( i = 0; i < m_num_sites; i++ )
+#pragma omp parallel for num_threads(m_numThreads) schedule(static) reduction(+:eng) if(m_numThreads > 1)
+	for ( SiteID i = 0; i < m_num_sites; i++ )
 	{
+		SiteID numN,*nPointer,nSite,n;
+		EnergyTermType *weights;
 		giveNeighborInfo(i,&numN,&nPointer,&weights);
 		for ( n = 0; n < numN; n++ )
 		{
@@ -280,7 +726,7 @@ OLGA_INLINE void GCoptimization::addterm1_checked(EnergyT* e, VarID i, EnergyTer
 {
 	if ( e0 > GCO_MAX_ENERGYTERM || e1 > GCO_MAX_ENERGYTERM )
 		handleError("Data cost term was larger than GCO_MAX_ENERGYTERM; danger of integer overflow.");
-	m_beforeExpansionEnergy += e1;
+	e->add_keep_energy(e->stored(e1));
 	e->add_term1(i,e0,e1);
 }
 
@@ -290,7 +736,7 @@ OLGA_INLINE void GCoptimization::addterm1_checked(EnergyT* e, VarID i, EnergyTer
 		handleError("Smooth cost term was larger than GCO_MAX_ENERGYTERM; danger of integer overflow.");
 	if ( w > GCO_MAX_ENERGYTERM )
 		handleError("Smoothness weight was larger than GCO_MAX_ENERGYTERM; danger of integer overflow.");
-	m_beforeExpansionEnergy += e1*w;
+	e->add_keep_energy(e->stored(e1*w));
 	e->add_term1(i,e0*w,e1*w);
 }
 
@@ -304,7 +750,7 @@ OLGA_INLINE void GCoptimization::addterm2_checked(EnergyT* e, VarID i, VarID j,
 	// but is optimized out. We check it in release builds as well.
 	if ( e00+e11 > e01+e10 )
 		handleError("Non-submodular expansion term detected; smooth costs must be a metric for expansion");
-	m_beforeExpansionEnergy += e11*w;
+	e->add_keep_energy(e->stored(e11*w));
 	e->add_term2(i,j,e00*w,e01*w,e10*w,e11*w);
 }
 
@@ -326,20 +772,36 @@ template <typename DataCostT>
 void GCoptimization::setupDataCostsExpansion(SiteID size,LabelID alpha_label,EnergyT *e,SiteID *activeSites)
 {
 	DataCostT* dc = (DataCostT*)m_datacostFn;
-	for ( SiteID i = 0; i < size; ++i )
-		addterm1_checked(e,i,dc->compute(activeSites[i],alpha_label),m_labelingDataCosts[activeSites[i]]);
+	if ( m_numThreads <= 1 || !concurrentDataCosts<DataCostT>() )
+	{
+		for ( SiteID i = 0; i < size; ++i )
+			addterm1_checked(e,i,dc->compute(activeSites[i],alpha_label),m_labelingDataCosts[activeSites[i]]);
+		return;
+	}
+
+	// Costs of a chunk of sites are computed in parallel, then added serially
+	const SiteID cChunkSize = 1 << 16;
+	std::vector<EnergyTermType> costs(std::min(size,cChunkSize));
+	for ( SiteID begin = 0; begin < size; begin += cChunkSize )
+	{
+		SiteID count = std::min(size - begin,cChunkSize);
+#pragma omp parallel for num_threads(m_numThreads) schedule(static)
+		for ( SiteID i = 0; i < count; ++i )
+			costs[i] = dc->compute(activeSites[begin+i],alpha_label);
+		for ( SiteID i = 0; i < count; ++i )
+			addterm1_checked(e,begin+i,costs[i],m_labelingDataCosts[activeSites[begin+i]]);
+	}
 }
 
 //-------------------------------------------------------------------
 
 template <typename SmoothCostT>
-void GCoptimization::setupSmoothCostsExpansion(SiteID size,LabelID alpha_label,EnergyT *e,SiteID *activeSites)
+void GCoptimization::collectSmoothCostsExpansion(SmoothBatch& batch,SiteID begin,SiteID end,LabelID alpha_label,SiteID *activeSites)
 {
 	SiteID i,nSite,site,n,nNum,*nPointer;
 	EnergyTermType *weights;
-	SmoothCostT* sc = (SmoothCostT*)m_smoothcostFn;
 
-	for ( i = size - 1; i >= 0; i-- )
+	for ( i = end - 1; i >= begin; i-- )
 	{
 		site = activeSites[i];
 		giveNeighborInfo(site,&nNum,&nPointer,&weights);
@@ -347,20 +809,90 @@ void GCoptimization::setupSmoothCostsExpansion(SiteID size,LabelID alpha_label,E
 		{
 			nSite = nPointer[n];
 			if ( m_lookupSiteVar[nSite] == -1 ) 
-				addterm1_checked(e,i,sc->compute(site,nSite,alpha_label,m_labeling[nSite]),
-				                     sc->compute(site,nSite,m_labeling[site],m_labeling[nSite]),weights[n]);
+			{
+				SmoothBatch::Term t = { i, -1, weights[n] };
+				batch.terms.push_back(t);
+				batch.query(site,nSite,alpha_label,m_labeling[nSite]);
+				batch.query(site,nSite,m_labeling[site],m_labeling[nSite]);
+			}
 			else if ( nSite < site ) 
 			{
-				addterm2_checked(e,i,m_lookupSiteVar[nSite],
-				                 sc->compute(site,nSite,alpha_label,alpha_label),
-				                 sc->compute(site,nSite,alpha_label,m_labeling[nSite]),
-				                 sc->compute(site,nSite,m_labeling[site],alpha_label),
-				                 sc->compute(site,nSite,m_labeling[site],m_labeling[nSite]),weights[n]);
+				SmoothBatch::Term t = { i, m_lookupSiteVar[nSite], weights[n] };
+				batch.terms.push_back(t);
+				batch.query(site,nSite,alpha_label,alpha_label);
+				batch.query(site,nSite,alpha_label,m_labeling[nSite]);
+				batch.query(site,nSite,m_labeling[site],alpha_label);
+				batch.query(site,nSite,m_labeling[site],m_labeling[nSite]);
 			}
 		}
 	}
 }
 
+template <typename SmoothCostT>
+void GCoptimization::computeSmoothBatch(SmoothCostT* sc, SmoothBatch& batch)
+{
+	SiteID count = (SiteID)batch.s1.size();
+	batch.costs.resize(count);
+	for ( SiteID k = 0; k < count; ++k )
+		batch.costs[k] = sc->compute(batch.s1[k],batch.s2[k],batch.l1[k],batch.l2[k]);
+}
+
+// User functors may evaluate a whole batch at once (e.g. with SIMD)
+void GCoptimization::computeSmoothBatch(SmoothCostFunctor* sc, SmoothBatch& batch)
+{
+	SiteID count = (SiteID)batch.s1.size();
+	batch.costs.resize(count);
+	if ( count )
+		sc->computeBatch(count,&batch.s1[0],&batch.s2[0],&batch.l1[0],&batch.l2[0],&batch.costs[0]);
+}
+
+void GCoptimization::addSmoothBatch(EnergyT *e, SmoothBatch& batch)
+{
+	const EnergyTermType* c = batch.costs.empty() ? 0 : &batch.costs[0];
+	for ( size_t t = 0; t < batch.terms.size(); ++t )
+	{
+		const SmoothBatch::Term& term = batch.terms[t];
+		if ( term.j == -1 ) {
+			addterm1_checked(e,term.i,c[0],c[1],term.w);
+			c += 2;
+		} else {
+			addterm2_checked(e,term.i,term.j,c[0],c[1],c[2],c[3],term.w);
+			c += 4;
+		}
+	}
+}
+
+//-------------------------------------------------------------------
+// Active sites are visited from last to first in bands of cBandSize sites.
+// Each band gathers its terms and queries all their smooth costs in one batch;
+// with several threads the bands of a chunk are gathered concurrently, and then
+// added to the graph serially in the original order.
+
+template <typename SmoothCostT>
+void GCoptimization::setupSmoothCostsExpansion(SiteID size,LabelID alpha_label,EnergyT *e,SiteID *activeSites)
+{
+	const SiteID cBandSize = 1024;
+	SmoothCostT* sc = (SmoothCostT*)m_smoothcostFn;
+	const int numBands = m_numThreads > 1 ? 8*m_numThreads : 1;
+	std::vector<SmoothBatch> batches(numBands);
+
+	for ( SiteID end = size; end > 0; end -= cBandSize*numBands )
+	{
+		int bands = (int)std::min<SiteID>(numBands, (end + cBandSize - 1)/cBandSize);
+#pragma omp parallel for num_threads(m_numThreads) schedule(dynamic) if(bands > 1)
+		for ( int b = 0; b < bands; ++b )
+		{
+			SiteID bandEnd   = end - b*cBandSize;
+			SiteID bandBegin = std::max<SiteID>(bandEnd - cBandSize, 0);
+			batches[b].clear();
+			collectSmoothCostsExpansion<SmoothCostT>(batches[b],bandBegin,bandEnd,alpha_label,activeSites);
+			computeSmoothBatch(sc,batches[b]);
+		}
+		for ( int b = 0; b < bands; ++b )
+			addSmoothBatch(e,batches[b]);
+	}
+}
+
 //-----------------------------------------------------------------------------------
 
 template <typename DataCostT>
@@ -370,6 +902,9 @@ void GCoptimization::setupDataCostsSwap(SiteID size, LabelID alpha_label, LabelI
 	DataCostT* dc = (DataCostT*)m_datacostFn;
 	for ( SiteID i = 0; i < size; i++ )
 	{
+		LabelID l = m_labeling[activeSites[i]];
+		if ( l != alpha_label && l != beta_label )
+			continue; // only with setGraphReuse; the site keeps its label either way
 		e->add_term1(i,dc->compute(activeSites[i],alpha_label),
 		               dc->compute(activeSites[i],beta_label) );
 	}
@@ -388,20 +923,32 @@ void GCoptimization::setupSmoothCostsSwap(SiteID size, LabelID alpha_label,Label
 	for ( i = size - 1; i >= 0; i-- )
 	{
 		site = activeSites[i];
+		// With setGraphReuse, active sites not labeled alpha or beta keep their label for 0 and 1,
+		// but still get a (constant) term with each active neighbor so that the graph keeps its shape
+		LabelID l0 = m_labeling[site], l1 = l0;
+		if ( l0 == alpha_label || l0 == beta_label ) { l0 = alpha_label; l1 = beta_label; }
 		giveNeighborInfo(site,&nNum,&nPointer,&weights);
 		for ( n = 0; n < nNum; n++ )
 		{
 			nSite = nPointer[n];
-			if ( m_lookupSiteVar[nSite] == -1 )
-				addterm1_checked(e,i,sc->compute(site,nSite,alpha_label,m_labeling[nSite]),
-				                     sc->compute(site,nSite,beta_label, m_labeling[nSite]),weights[n]);
+			// without graph reuse only sites labeled alpha or beta are variables; the label
+			// is tested first as other pairs of oneParallelSwapIteration write their own sites
+			LabelID nl = m_labeling[nSite];
+			if ( (!m_graphReuse && nl != alpha_label && nl != beta_label) || m_lookupSiteVar[nSite] == -1 )
+			{
+				if ( l0 != l1 )
+					addterm1_checked(e,i,sc->compute(site,nSite,alpha_label,m_labeling[nSite]),
+					                     sc->compute(site,nSite,beta_label, m_labeling[nSite]),weights[n]);
+			}
 			else if ( nSite < site )
 			{
+				LabelID n0 = m_labeling[nSite], n1 = n0;
+				if ( n0 == alpha_label || n0 == beta_label ) { n0 = alpha_label; n1 = beta_label; }
 				addterm2_checked(e,i,m_lookupSiteVar[nSite],
-				                 sc->compute(site,nSite,alpha_label,alpha_label),
-				                 sc->compute(site,nSite,alpha_label,beta_label),
-				                 sc->compute(site,nSite,beta_label,alpha_label),
-				                 sc->compute(site,nSite,beta_label,beta_label),weights[n]);
+				                 sc->compute(site,nSite,l0,n0),
+				                 sc->compute(site,nSite,l0,n1),
+				                 sc->compute(site,nSite,l1,n0),
+				                 sc->compute(site,nSite,l1,n1),weights[n]);
 			}
 		}
 	}
@@ -413,6 +960,35 @@ template <typename DataCostT>
 void GCoptimization::applyNewLabeling(EnergyT *e,SiteID *activeSites,SiteID size,LabelID alpha_label)
 {
 	DataCostT* dc = (DataCostT*)m_datacostFn;
+	if ( m_numThreads > 1 && concurrentDataCosts<DataCostT>() )
+	{
+		// Each thread counts the labels it replaced, counts are merged afterwards
+#pragma omp parallel num_threads(m_numThreads)
+		{
+			std::vector<SiteID> replaced(m_num_labels,0);
+#pragma omp for schedule(static)
+			for ( SiteID i = 0; i < size; i++ )
+			{
+				if ( e->get_var(i) == 0 )
+				{
+					SiteID site = activeSites[i];
+					replaced[m_labeling[site]]++;
+					m_labeling[site] = alpha_label;
+					m_labelingDataCosts[site] = dc->compute(site,alpha_label);
+				}
+			}
+#pragma omp critical
+			for ( LabelID l = 0; l < m_num_labels; ++l )
+			{
+				m_labelCounts[alpha_label] += replaced[l];
+				m_labelCounts[l] -= replaced[l];
+			}
+		}
+		m_labelingInfoDirty = true;
+		updateLabelingInfo(false,true,false); // labels have changed, so update necessary labeling info
+		return;
+	}
+
 	for ( SiteID i = 0; i < size; i++ )
 	{
 		if ( e->get_var(i) == 0 )
@@ -435,6 +1011,8 @@ template <typename DataCostT>
 void GCoptimization::updateLabelingDataCosts()
 {
 	DataCostT* dc = (DataCostT*)m_datacostFn;
+	const bool parallel = m_numThreads > 1 && concurrentDataCosts<DataCostT>();
+#pragma omp parallel for num_threads(m_numThreads) schedule(static) if(parallel)
 	for (int i = 0; i < m_num_sites; ++i)
 		m_labelingDataCosts[i] = dc->compute(i,m_labeling[i]);
 }
@@ -557,6 +1135,7 @@ public:
 	}
 	OLGA_INLINE EnergyTermType compute() const { return m_site.cost(); }
 	OLGA_INLINE SiteID feasibleSites() const { return (SiteID)(m_siteend - m_site); }
+	OLGA_INLINE EnergyTermType unlistedCost() const { return m_dc.getDefault(); }
 
 private:
 	DataCostFnSparse::iterator m_site;
@@ -598,7 +1177,7 @@ GCoptimization::EnergyType GCoptimization::solveGreedy()
 			for ( LabelCostIter* lci = m_labelcostsByLabel[l]; lci; lci = lci->next )
 				e[l] += lci->node->cost;
 			iter.start(&l);
-			e[l] += (EnergyType)(m_num_sites - iter.feasibleSites()) * GCO_MAX_ENERGYTERM; // pre-add GCO_MAX_ENERGYTERM for all infeasible sites
+			e[l] += (EnergyType)(m_num_sites - iter.feasibleSites()) * iter.unlistedCost(); // pre-add cost of all unlisted (usually infeasible) sites
 			for (; !iter.done(); ++iter) {
 				EnergyTermType dataCost = iter.compute();
 				if ( dataCost > GCO_MAX_ENERGYTERM )
@@ -785,6 +1364,21 @@ void GCoptimization::setDataCost(LabelID l, SparseDataCost *costs, SiteID count)
 
 //-------------------------------------------------------------------
 
+void GCoptimization::setSparseDataCostDefault(EnergyTermType e)
+{
+	if ( e > GCO_MAX_ENERGYTERM )
+		handleError("Data cost was larger than GCO_MAX_ENERGYTERM; danger of integer overflow.");
+	if ( !m_datacostFn )
+		specializeDataCostFunctor(DataCostFnSparse(numSites(),numLabels()));
+	else if ( m_queryActiveSitesExpansion != (SiteID (GCoptimization::*)(LabelID,SiteID*))&GCoptimization::queryActiveSitesExpansion<DataCostFnSparse> )
+		handleError("Cannot apply sparse data costs after dense data costs have been used.");
+	m_labelingInfoDirty = true;
+	DataCostFnSparse* dc = (DataCostFnSparse*)m_datacostFn;
+	dc->setDefault(e);
+}
+
+//-------------------------------------------------------------------
+
 void GCoptimization::setSmoothCost(SmoothCostFn fn) {
 	specializeSmoothCostFunctor(SmoothCostFnFromFunction(fn));
 }
@@ -922,11 +1516,157 @@ GCoptimization::EnergyType GCoptimization::giveDataEnergy()
 {
 	updateLabelingInfo();
 	EnergyType energy = 0;
+#pragma omp parallel for num_threads(m_numThreads) schedule(static) reduction(+:energy) if(m_numThreads > 1)
 	for ( SiteID i = 0; i < m_num_sites; i++ )
 		energy += m_labelingDataCosts[i];
 	return energy;
 }
 
+void GCoptimization::setFreeSites(const SiteID* sites, SiteID count)
+{
+	clearReusedGraphs(); // kept graphs are over the previous free sites
+	if ( m_freeSites )
+	{
+		delete [] m_freeSites;
+		m_freeSites = 0;
+		m_freeSitesCount = 0;
+	}
+	if ( count <= 0 )
+		return;
+
+	// Sorted sites keep sparse data cost lookups sequential
+	m_freeSites = new SiteID[count];
+	memcpy(m_freeSites,sites,count*sizeof(SiteID));
+	std::sort(m_freeSites,m_freeSites+count);
+	for ( SiteID i = 0; i < count; i++ )
+		if ( m_freeSites[i] < 0 || m_freeSites[i] >= m_num_sites || (i > 0 && m_freeSites[i] == m_freeSites[i-1]) )
+			handleError("Free sites must be distinct and within range.");
+	m_freeSitesCount = count;
+}
+
+//-------------------------------------------------------------------
+
+void GCoptimization::setNumThreads(int numThreads)
+{
+	m_numThreads = numThreads > 1 ? numThreads : 1;
+}
+
+//-------------------------------------------------------------------
+
+void GCoptimization::setGraphPrecision(GraphPrecision precision, EnergyTermType scale)
+{
+	if ( precision == GraphInt32 && !(scale > 0) )
+		handleError("Scale of GraphInt32 must be positive.");
+	m_graphPrecision = precision;
+	m_graphScale = 1;
+	if ( precision == GraphInt32 )
+	{
+		int exponent;
+		frexp(scale,&exponent);
+		m_graphScale = ldexp(1.0,exponent-1);
+	}
+}
+
+// Graph for a move whose variables are the numSites sites, with room for
+// var_num_max variables and edge_num_max edges in the generic graph.
+
+GCoptimization::EnergyT* GCoptimization::newMoveEnergy(int var_num_max, int edge_num_max, const SiteID* sites, SiteID numSites)
+{
+	bool grid = (m_gridMaxflow || m_parallelMaxflow) && gridWidth() > 0 && !m_graphReuse && !m_labelcostsAll;
+	if ( grid )
+	{
+		int x0, y0, x1, y1;
+		EnergyT::GridDoubleT::bounding_box(sites,numSites,gridWidth(),x0,y0,x1,y1);
+		grid = (double)(x1-x0+1)*(y1-y0+1) <= (double)GCO_MAX_GRID_SPARSITY*numSites;
+	}
+	EnergyT* e = m_graphPool->take(m_graphPrecision,grid);
+	if ( e )
+		e->reset(m_graphScale,var_num_max,edge_num_max);
+	else
+		e = new EnergyT(m_graphPrecision,grid,m_graphScale,var_num_max,edge_num_max,handleError);
+	if ( grid )
+		e->set_grid_sites(sites,numSites,gridWidth(),
+			m_parallelMaxflow && numSites >= GCO_MIN_PARALLEL_MAXFLOW_SITES ? m_numThreads : 1);
+	e->set_interrupt(m_interruptFlag);
+	return e;
+}
+
+void GCoptimization::releaseMoveEnergy(EnergyT* e)
+{
+	if ( e )
+		m_graphPool->give(e);
+}
+
+//-------------------------------------------------------------------
+
+GCoptimization::EnergyT* GCoptimization::GraphPool::take(GraphPrecision precision, bool grid)
+{
+	EnergyT* e = 0;
+	#pragma omp critical(gco_graph_pool)
+	for ( size_t k = m_idle.size(); k-- > 0; )
+		if ( m_idle[k]->precision() == precision && m_idle[k]->grid() == grid )
+		{
+			e = m_idle[k];
+			m_idle.erase(m_idle.begin()+k);
+			break;
+		}
+	return e;
+}
+
+void GCoptimization::GraphPool::give(EnergyT* e)
+{
+	#pragma omp critical(gco_graph_pool)
+	m_idle.push_back(e);
+}
+
+void GCoptimization::GraphPool::clear()
+{
+	#pragma omp critical(gco_graph_pool)
+	{
+		for ( size_t k = 0; k < m_idle.size(); k++ )
+			delete m_idle[k];
+		m_idle.clear();
+	}
+}
+
+void GCoptimization::setGridMaxflow(bool grid)
+{
+	m_gridMaxflow = grid;
+}
+
+void GCoptimization::setParallelMaxflow(bool parallel)
+{
+	m_parallelMaxflow = parallel;
+}
+
+void GCoptimization::setGraphPool(GraphPool* pool)
+{
+	m_graphPool = pool ? pool : &m_ownGraphPool;
+}
+
+//-------------------------------------------------------------------
+
+void GCoptimization::setInterruptFlag(const std::atomic<bool>* flag)
+{
+	m_interruptFlag = flag;
+}
+
+//-------------------------------------------------------------------
+
+void GCoptimization::setGraphReuse(bool reuse)
+{
+	if ( reuse && m_labelcostsAll )
+		handleError("Graph reuse is not available with label costs.");
+	m_graphReuse = reuse;
+	if ( !reuse )
+		clearReusedGraphs();
+}
+
+void GCoptimization::setParallelSwaps(bool parallel)
+{
+	m_parallelSwaps = parallel;
+}
+
 GCoptimization::EnergyType GCoptimization::giveLabelEnergy()
 {
 	updateLabelingInfo();
@@ -964,7 +1704,7 @@ void GCoptimization::permuteLabelTable()
 GCoptimization::EnergyType GCoptimization::expansion(int max_num_iterations)
 {
 	EnergyType new_energy, old_energy;
-	if ( (this->*m_solveSpecialCases)(new_energy) )
+	if ( !m_freeSites && (this->*m_solveSpecialCases)(new_energy) )
 		return new_energy;
 
 	permuteLabelTable();
@@ -1077,8 +1817,12 @@ void GCoptimization::handleError(const char *message)
 
 void GCoptimization::checkInterrupt()
 {
-	if ( utIsInterruptPending() )
+	if ( utIsInterruptPending() || (m_interruptFlag && m_interruptFlag->load()) )
+	{
+		if ( m_graphReuse )
+			clearReusedGraphs(); // an interrupted maxflow leaves its graph unusable
 		throw GCException("Interrupted.");
+	}
 }
 
 
@@ -1143,7 +1887,7 @@ GCoptimization::EnergyType GCoptimization::setupLabelCostsExpansion(SiteID size,
 			{
 				lc->aux = e->add_variable();
 				e->add_term1(lc->aux,0,lc->cost);
-				m_beforeExpansionEnergy += lc->cost;
+				e->add_keep_energy(lc->cost);
 			}
 			e->add_term2(i,lc->aux,0,0,lc->cost,0);
 		}
@@ -1210,10 +1954,17 @@ bool GCoptimization::alpha_expansion(LabelID alpha_label)
 	SiteID size = 0;
 	SiteID *activeSites = new SiteID[m_num_sites];
 	EnergyType afterExpansionEnergy = 0;
+	EnergyT *e = 0;      // graph built for this move, owned here unless handed to solveReused
+	EnergyT *solved = 0;
+	bool reuse = m_graphReuse && !m_labelcostsAll;
 	try 
 	{
 		// Get list of active sites based on alpha and current labeling
-		if ( m_queryActiveSitesExpansion )
+		if ( reuse )
+			size = queryMovableSites(activeSites);
+		else if ( m_freeSites )
+			size = queryFreeSitesExpansion(alpha_label,activeSites);
+		else if ( m_queryActiveSitesExpansion )
 			size = (this->*m_queryActiveSitesExpansion)(alpha_label,activeSites);
 		if ( size == 0 )  // Nothing to do
 		{
@@ -1229,20 +1980,32 @@ bool GCoptimization::alpha_expansion(LabelID alpha_label)
 
 		// Create binary variables for each remaining site, add the data costs,
 		// and compute the smooth costs between variables.
-		EnergyT e(size+m_labelcostCount, // poor guess at number of pairwise terms needed :(
-				 m_numNeighborsTotal+(m_labelcostCount?size+m_labelcostCount : 0),
-				 handleError);
-		e.add_variable(size);
-		m_beforeExpansionEnergy = 0;
-		if ( m_setupDataCostsExpansion   ) (this->*m_setupDataCostsExpansion  )(size,alpha_label,&e,activeSites);
-		if ( m_setupSmoothCostsExpansion ) (this->*m_setupSmoothCostsExpansion)(size,alpha_label,&e,activeSites);
-		EnergyType alphaCorrection = setupLabelCostsExpansion(size,alpha_label,&e,activeSites);
+		e = newMoveEnergy(size+m_labelcostCount, // poor guess at number of pairwise terms needed :(
+				 m_numNeighborsTotal+(m_labelcostCount?size+m_labelcostCount : 0),activeSites,size);
+		e->add_variable(size);
+		if ( m_setupDataCostsExpansion   ) (this->*m_setupDataCostsExpansion  )(size,alpha_label,e,activeSites);
+		if ( m_setupSmoothCostsExpansion ) (this->*m_setupSmoothCostsExpansion)(size,alpha_label,e,activeSites);
+		EnergyType alphaCorrection = setupLabelCostsExpansion(size,alpha_label,e,activeSites);
+		m_beforeExpansionEnergy = e->keep_energy();
 		checkInterrupt();
-		afterExpansionEnergy = e.minimize() + alphaCorrection;
+		if ( reuse )
+		{
+			// sites already labeled alpha are variables too, choosing 1 keeps the labeling
+			EnergyType gain;
+			EnergyT *fresh = e;
+			e = 0;
+			solved = solveReused(alpha_label,fresh,&gain);
+			afterExpansionEnergy = m_beforeExpansionEnergy + gain;
+		}
+		else
+		{
+			afterExpansionEnergy = e->minimize() + alphaCorrection;
+			solved = e;
+		}
 		checkInterrupt();
 
-		if ( afterExpansionEnergy < m_beforeExpansionEnergy )
-			(this->*m_applyNewLabeling)(&e,activeSites,size,alpha_label);
+		if ( moveImproves(m_beforeExpansionEnergy,afterExpansionEnergy) )
+			(this->*m_applyNewLabeling)(solved,activeSites,size,alpha_label);
 
 		for ( SiteID i = 0; i < size; i++ )
 			m_lookupSiteVar[activeSites[i]] = -1; // restore m_lookupSite to all -1s
@@ -1251,11 +2014,24 @@ bool GCoptimization::alpha_expansion(LabelID alpha_label)
 	} 
 	catch (...)
 	{
+		releaseMoveEnergy(e);
 		delete [] activeSites;
 		throw;
 	}
+	releaseMoveEnergy(e);
 	delete [] activeSites;
-	return afterExpansionEnergy < m_beforeExpansionEnergy;
+	return moveImproves(m_beforeExpansionEnergy,afterExpansionEnergy);
+}
+
+//-------------------------------------------------------------------
+// Float capacities round every term, so the energy of a move that changes
+// nothing may still come out slightly lower than the energy before it.
+
+bool GCoptimization::moveImproves(EnergyType before, EnergyType after) const
+{
+	if ( m_graphPrecision == GraphFloat )
+		return after < before - GCO_FLOAT_MOVE_TOLERANCE*fabs((double)before);
+	return after < before;
 }
 
 //-------------------------------------------------------------------
@@ -1280,7 +2056,7 @@ GCoptimization::EnergyType GCoptimization::oneExpansionIteration()
 GCoptimization::EnergyType GCoptimization::swap(int max_num_iterations)
 {
 	EnergyType new_energy,old_energy;
-	if ( (this->*m_solveSpecialCases)(new_energy) )
+	if ( !m_freeSites && (this->*m_solveSpecialCases)(new_energy) )
 		return new_energy;
 	
 	new_energy = compute_energy();
@@ -1297,7 +2073,9 @@ GCoptimization::EnergyType GCoptimization::swap(int max_num_iterations)
 		{
 			gcoclock_t ticks0 = gcoclock();
 			old_energy = new_energy;
-			new_energy = oneSwapIteration();
+			new_energy = m_parallelSwaps && m_numThreads > 1 && !m_graphReuse && !m_labelcostsAll
+				&& concurrentSwapDataCosts() ?
+				oneParallelSwapIteration() : oneSwapIteration();
 			printStatus1(curr_cycle,true,ticks0);
 			curr_cycle++;
 		}
@@ -1331,29 +2109,118 @@ GCoptimization::EnergyType GCoptimization::oneSwapIteration()
 	return(compute_energy());
 }
 
+//--------------------------------------------------------------------------------
+// Label pairs are scheduled by the circle method: label 0 (in m_labelTable order)
+// stays, the others rotate, and position k plays position n-1-k. With an odd number
+// of labels one position is a bye. Every pair is met once in n-1 rounds.
+
+GCoptimization::EnergyType GCoptimization::oneParallelSwapIteration()
+{
+	permuteLabelTable();
+	m_stepsThisCycle = 0;
+	finalizeNeighbors();
+
+	const LabelID n = m_num_labels + (m_num_labels & 1);
+	std::vector<LabelID> before(m_labeling, m_labeling + m_num_sites);
+	std::vector<LabelID> next(before);
+	std::vector<std::pair<LabelID,LabelID> > pairs;
+	EnergyType energy = compute_energy();
+	for ( LabelID round = 0; round < n - 1; round++ )
+	{
+		pairs.clear();
+		for ( LabelID k = 0; k < n/2; k++ )
+		{
+			LabelID a = k == 0 ? 0 : 1 + (k - 1 + round) % (n - 1);
+			LabelID b = 1 + (n - 2 - k + round) % (n - 1);
+			if ( a < m_num_labels && b < m_num_labels )
+				pairs.push_back(std::make_pair(m_labelTable[a],m_labelTable[b]));
+		}
+
+		// m_labeling stays the labeling before the round while its pairs are solved,
+		// each pair writes the sites it swapped to next
+		const char* error = 0;
+#pragma omp parallel for num_threads(m_numThreads) schedule(dynamic)
+		for ( int p = 0; p < (int)pairs.size(); p++ )
+		{
+			try
+			{
+				swapInto(pairs[p].first,pairs[p].second,&next[0]);
+			}
+			catch (GCException e)
+			{
+#pragma omp critical(gco_parallel_swap_error)
+				if ( !error ) error = e.message;
+			}
+			catch (...)
+			{
+#pragma omp critical(gco_parallel_swap_error)
+				if ( !error ) error = "Failed to solve a swap.";
+			}
+		}
+		if ( error )
+			throw GCException(error);
+
+		std::copy(next.begin(),next.end(),m_labeling);
+		m_labelingInfoDirty = true;
+		EnergyType after = compute_energy();
+		if ( after > energy )
+		{
+			// a pair saw the neighbours of other pairs as they were before the round
+			std::copy(before.begin(),before.end(),m_labeling);
+			for ( size_t p = 0; p < pairs.size(); p++ )
+				alpha_beta_swap(pairs[p].first,pairs[p].second);
+			after = compute_energy();
+			std::copy(m_labeling,m_labeling + m_num_sites,next.begin());
+		}
+		std::copy(next.begin(),next.end(),before.begin());
+		energy = after;
+		m_stepsThisCycle += (int)pairs.size();
+	}
+	return energy;
+}
+
 //---------------------------------------------------------------------------------
 
 void GCoptimization::alpha_beta_swap(LabelID alpha_label, LabelID beta_label)
+{
+	finalizeNeighbors();
+	swapInto(alpha_label,beta_label,m_labeling);
+}
+
+void GCoptimization::swapInto(LabelID alpha_label, LabelID beta_label, LabelID *labeling)
 {
 	assert( alpha_label >= 0 && alpha_label < m_num_labels && beta_label >= 0 && beta_label < m_num_labels);
 	if ( m_labelcostsAll )
 		handleError("Label costs only implemented for alpha-expansion.");
 
-	finalizeNeighbors();
 	gcoclock_t ticks0 = gcoclock();
 
 	// Determine the list of active sites for this swap move
 	SiteID size = 0;
 	SiteID *activeSites = new SiteID[m_num_sites];
+	EnergyT *e = 0;
+	EnergyT *solved = 0;
 	try
 	{
-		for ( SiteID i = 0; i < m_num_sites; i++ )
+		if ( m_graphReuse )
 		{
-			if ( m_labeling[i] == alpha_label || m_labeling[i] == beta_label )
+			// every movable site is a variable, those not labeled alpha or beta have constant terms
+			size = queryMovableSites(activeSites);
+			for ( SiteID i = 0; i < size; i++ )
+				m_lookupSiteVar[activeSites[i]] = i;
+		}
+		else
+		{
+			SiteID count = m_freeSites ? m_freeSitesCount : m_num_sites;
+			for ( SiteID k = 0; k < count; k++ )
 			{
-				activeSites[size] = i;
-				m_lookupSiteVar[i] = size;
-				size++;
+				SiteID i = m_freeSites ? m_freeSites[k] : k;
+				if ( m_labeling[i] == alpha_label || m_labeling[i] == beta_label )
+				{
+					activeSites[size] = i;
+					m_lookupSiteVar[i] = size;
+					size++;
+				}
 			}
 		}
 		if ( size == 0 )
@@ -1365,27 +2232,43 @@ void GCoptimization::alpha_beta_swap(LabelID alpha_label, LabelID beta_label)
 
 		// Create binary variables for each remaining site, add the data costs,
 		// and compute the smooth costs between variables.
-		EnergyT e(size,m_numNeighborsTotal,handleError);
-		e.add_variable(size);
-		if ( m_setupDataCostsSwap   ) (this->*m_setupDataCostsSwap  )(size,alpha_label,beta_label,&e,activeSites);
-		if ( m_setupSmoothCostsSwap ) (this->*m_setupSmoothCostsSwap)(size,alpha_label,beta_label,&e,activeSites);
+		e = newMoveEnergy(size,m_numNeighborsTotal,activeSites,size);
+		e->add_variable(size);
+		if ( m_setupDataCostsSwap   ) (this->*m_setupDataCostsSwap  )(size,alpha_label,beta_label,e,activeSites);
+		if ( m_setupSmoothCostsSwap ) (this->*m_setupSmoothCostsSwap)(size,alpha_label,beta_label,e,activeSites);
 		checkInterrupt();
-		e.minimize();
+		if ( m_graphReuse )
+		{
+			EnergyT *fresh = e;
+			e = 0;
+			solved = solveReused((size_t)(std::min(alpha_label,beta_label)+1)*m_num_labels+std::max(alpha_label,beta_label),fresh,0);
+		}
+		else
+		{
+			e->minimize();
+			solved = e;
+		}
 		checkInterrupt();
 		
 		// Apply the new labeling
 		for ( SiteID i = 0; i < size; i++ )
 		{
-			m_labeling[activeSites[i]] = (e.get_var(i) == 0) ? alpha_label : beta_label;
-			m_lookupSiteVar[activeSites[i]] = -1; // restore lookupSiteVar to all -1s
+			SiteID site = activeSites[i];
+			if ( m_labeling[site] == alpha_label || m_labeling[site] == beta_label )
+				labeling[site] = (solved->get_var(i) == 0) ? alpha_label : beta_label;
+			m_lookupSiteVar[site] = -1; // restore lookupSiteVar to all -1s
 		}
-		m_labelingInfoDirty = true;
+		// swaps into another labeling run concurrently, their caller marks it dirty once
+		if ( labeling == m_labeling )
+			m_labelingInfoDirty = true;
 	} 
 	catch (...)
 	{
+		releaseMoveEnergy(e);
 		delete [] activeSites;
 		throw;
 	}
+	releaseMoveEnergy(e);
 	delete [] activeSites;
 
 	printStatus2(alpha_label,beta_label,size,ticks0);
@@ -1748,6 +2631,7 @@ GCoptimization::DataCostFnSparse::DataCostFnSparse(SiteID num_sites, LabelID num
 , m_num_labels(num_labels)
 , m_buckets_per_label((m_num_sites + cSitesPerBucket-1)/cSitesPerBucket)
 , m_buckets(0)
+, m_default(GCO_MAX_ENERGYTERM)
 {
 }
 
@@ -1756,6 +2640,7 @@ GCoptimization::DataCostFnSparse::DataCostFnSparse(const DataCostFnSparse& src)
 , m_num_labels(src.m_num_labels)
 , m_buckets_per_label(src.m_buckets_per_label)
 , m_buckets(0)
+, m_default(src.m_default)
 {
 	assert(!src.m_buckets); // not implemented
 }
@@ -1839,14 +2724,14 @@ GCoptimization::EnergyTermType GCoptimization::DataCostFnSparse::search(DataCost
 	} while (++L <= R);
 	b.predict = L;
 
-	return GCO_MAX_ENERGYTERM; // the site belongs to this bucket but with no cost specified
+	return m_default; // the site belongs to this bucket but with no cost specified
 }
 
 OLGA_INLINE GCoptimization::EnergyTermType GCoptimization::DataCostFnSparse::compute(SiteID s, LabelID l)
 {
 	DataCostBucket& b = m_buckets[l*m_buckets_per_label + (s >> cLogSitesPerBucket)];
 	if (b.begin == b.end)
-		return GCO_MAX_ENERGYTERM;
+		return m_default;
 	if (b.predict < b.end) {
 		// Check for correct prediction
 		if (b.predict->site == s)
@@ -1855,7 +2740,7 @@ OLGA_INLINE GCoptimization::EnergyTermType GCoptimization::DataCostFnSparse::com
 		// If the requested site is missing from the site ids near 'predict'
 		// then we know it doesn't exist in the bucket, so return INF
 		if (b.predict->site > s && b.predict > b.begin && (b.predict-1)->site < s)
-			return GCO_MAX_ENERGYTERM;
+			return m_default;
 	}
 	if ( (size_t)b.end - (size_t)b.begin == cSitesPerBucket*sizeof(SparseDataCost) )
 		return b.begin[s-b.begin->site].cost; // special case: this particular bucket is actually dense!
@@ -1865,9 +2750,16 @@ OLGA_INLINE GCoptimization::EnergyTermType GCoptimization::DataCostFnSparse::com
 
 GCoptimization::SiteID GCoptimization::DataCostFnSparse::queryActiveSitesExpansion(LabelID alpha_label, const LabelID* labeling, SiteID* activeSites)
 {
+	SiteID count = 0;
+	if ( m_default < GCO_MAX_ENERGYTERM ) {
+		// Unlisted sites are feasible too, so every site may switch to alpha
+		for ( SiteID s = 0; s < m_num_sites; ++s )
+			if ( labeling[s] != alpha_label )
+				activeSites[count++] = s;
+		return count;
+	}
 	const SparseDataCost* next = m_buckets[alpha_label*m_buckets_per_label].begin;
 	const SparseDataCost* end  = m_buckets[alpha_label*m_buckets_per_label + m_buckets_per_label-1].end;
-	SiteID count = 0;
 	for (; next < end; ++next) {
 		if ( labeling[next->site] != alpha_label )
 			activeSites[count++] = next->site;
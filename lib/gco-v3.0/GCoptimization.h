@@ -106,7 +106,9 @@
 #endif
 
 #include <cstddef>
+#include <vector>
 #include "energy.h"
+#include "gridgraph.h"
 #include "graph.cpp"
 #include "maxflow.cpp"
 
@@ -142,6 +144,26 @@ extern "C" gcoclock_t GCO_CLOCKS_PER_SEC; // this variable will stay 0 until gco
                                      // the library will raise an exception
 #endif
 
+#ifndef GCO_MAX_GRAPHTERM_INT32
+#define GCO_MAX_GRAPHTERM_INT32 (1 << 26) // largest scaled term in a GraphInt32 graph, small enough
+                                          // that the terms summed on a node or arc cannot overflow
+#endif
+
+#ifndef GCO_FLOAT_MOVE_TOLERANCE
+#define GCO_FLOAT_MOVE_TOLERANCE 1e-6 // with GraphFloat an expansion is applied only if it lowers the
+                                      // energy by more than this fraction, above rounding noise
+#endif
+
+#ifndef GCO_MAX_GRID_SPARSITY
+#define GCO_MAX_GRID_SPARSITY 4 // a move whose sites fill less than 1/this of their bounding box is solved
+                                // by the generic graph, the grid maxflow would store the whole box
+#endif
+
+#ifndef GCO_MIN_PARALLEL_MAXFLOW_SITES
+#define GCO_MIN_PARALLEL_MAXFLOW_SITES (1 << 18) // smallest move solved by the parallel maxflow,
+                                                 // smaller ones are faster with the serial one
+#endif
+
 #if defined(GCO_ENERGYTYPE) && !defined(GCO_ENERGYTERMTYPE)
 #define GCO_ENERGYTERMTYPE GCO_ENERGYTYPE
 #endif
@@ -169,9 +191,88 @@ public:
 #endif
 	typedef double EnergyTermType;    // 32-bit energy terms
 #endif
-	typedef Energy<EnergyTermType,EnergyTermType,EnergyType> EnergyT;
+
+	// Precision of the capacities in the graph of each move, see setGraphPrecision
+	enum GraphPrecision { GraphDouble, GraphFloat, GraphInt32 };
+
+	// Graph of one move. Terms are given in cost units and stored with the chosen precision;
+	// GraphInt32 terms are multiplied by a power of 2 scale, rounded and clamped to
+	// GCO_MAX_GRAPHTERM_INT32. Energies it returns are in cost units again.
+	// With grid, it is a GridEnergy (gridgraph.h) instead of an Energy, see setGridMaxflow.
+	class MoveEnergy {
+	public:
+		typedef Energy<EnergyTermType,EnergyTermType,EnergyType> DoubleT;
+		typedef Energy<float,float,double> FloatT;
+		typedef Energy<int,int,long long> Int32T;
+		typedef GridEnergy<EnergyTermType,EnergyTermType,EnergyType> GridDoubleT;
+		typedef GridEnergy<float,float,double> GridFloatT;
+		typedef GridEnergy<int,int,long long> GridInt32T;
+		typedef DoubleT::Var Var;
+
+		MoveEnergy(GraphPrecision precision, bool grid, EnergyTermType scale, int var_num_max, int edge_num_max, void (*err_function)(const char *));
+		~MoveEnergy();
+		// Empties the graph for the next move, keeping its memory
+		void reset(EnergyTermType scale, int var_num_max, int edge_num_max);
+		// With grid, variable k of the next move is sites[k] of a grid that is width sites wide,
+		// and its maxflow runs on threads threads (see GridGraph::set_threads)
+		void set_grid_sites(const Var* sites, Var count, Var width, int threads);
+
+		Var  add_variable(int num=1);
+		void add_term1(Var x, EnergyTermType E0, EnergyTermType E1);
+		void add_term2(Var x, Var y, EnergyTermType E00, EnergyTermType E01, EnergyTermType E10, EnergyTermType E11);
+		EnergyType minimize();
+		int  get_var(Var x);
+		int  get_node_num();
+		int  get_arc_num();
+		void set_interrupt(const std::atomic<bool>* flag);
+
+		// Term value v as it is stored in the graph, in cost units
+		EnergyTermType stored(EnergyTermType v) const;
+		// Energy in graph units (e.g. a cut cost) converted to cost units
+		EnergyType unscale(EnergyType v) const { return v/m_scale; }
+		// Sum of the E1 and E11 terms added by GCoptimization, for an expansion
+		// the energy of keeping the current labeling
+		EnergyType keep_energy() const { return m_keepEnergy; }
+		void add_keep_energy(EnergyType v) { m_keepEnergy += v; }
+
+		GraphPrecision precision() const { return m_precision; }
+		bool grid() const { return m_gridDouble || m_gridFloat || m_gridInt32; }
+		DoubleT* m_double;
+		FloatT*  m_float;
+		Int32T*  m_int32;
+		GridDoubleT* m_gridDouble;
+		GridFloatT*  m_gridFloat;
+		GridInt32T*  m_gridInt32;
+
+	private:
+		int quantize(EnergyTermType v) const;
+		template <typename G, typename T> static void addTerm2(G* g, Var x, Var y, T A, T B, T C, T D);
+		GraphPrecision m_precision;
+		EnergyTermType m_scale;
+		EnergyType m_keepEnergy;
+	};
+	typedef MoveEnergy EnergyT;
 	typedef EnergyT::Var VarID;
 	typedef int LabelID;                     // Type for labels
+
+	// Graphs of finished moves. A move takes an idle graph of its precision and resets it
+	// instead of allocating a new one, so node and arc arrays are only allocated again when
+	// a move outgrows them. May be shared by GCoptimization objects that run concurrently
+	// or one after another, see setGraphPool.
+	class GraphPool {
+	public:
+		GraphPool() { }
+		~GraphPool() { clear(); }
+		// Frees the idle graphs
+		void clear();
+	private:
+		friend class GCoptimization;
+		GraphPool(const GraphPool&) = delete;
+		GraphPool& operator=(const GraphPool&) = delete;
+		EnergyT* take(GraphPrecision precision, bool grid); // 0 if none is idle
+		void give(EnergyT* e);
+		std::vector<EnergyT*> m_idle;
+	};
 	typedef VarID SiteID;                    // Type for sites
 	typedef EnergyTermType (*SmoothCostFn)(SiteID s1, SiteID s2, LabelID l1, LabelID l2);
 	typedef EnergyTermType (*DataCostFn)(SiteID s, LabelID l);
@@ -212,6 +313,9 @@ public:
 	void setDataCostFunctor(DataCostFunctor* f);
 	struct DataCostFunctor {
 		virtual EnergyTermType compute(SiteID s, LabelID l) = 0;
+		// Whether compute() may be called from several threads at once; otherwise
+		// data costs are only queried serially, whatever setNumThreads says.
+		virtual bool threadSafe() const { return false; }
 	};
 	// Set cost of assigning 'l' to a specific subset of sites.
 	// The sites are listed as (SiteID,cost) pairs.
@@ -220,6 +324,9 @@ public:
 		EnergyTermType cost;
 	};
 	void setDataCost(LabelID l, SparseDataCost *costs, SiteID count);
+	// Set cost of all (SiteID,LabelID) pairs not listed by sparse data costs.
+	// Defaults to GCO_MAX_ENERGYTERM, i.e. unlisted sites are infeasible for 'l'.
+	void setSparseDataCostDefault(EnergyTermType e);
 
 	// Set cost for all (LabelID,LabelID) pairs; the actual smooth cost is then weighted
 	// at each pair of on neighbors. Defaults to Potts model (0 if l1==l2, 1 otherwise)
@@ -230,6 +337,13 @@ public:
 	void setSmoothCostFunctor(SmoothCostFunctor* f);
 	struct SmoothCostFunctor {
 		virtual EnergyTermType compute(SiteID s1, SiteID s2, LabelID l1, LabelID l2) = 0;
+		// Batched form used by expansion setup: costs[k] = compute(s1[k],s2[k],l1[k],l2[k]).
+		// Override it to evaluate many neighbor pairs at once (e.g. with SIMD).
+		virtual void computeBatch(SiteID count, const SiteID* s1, const SiteID* s2,
+		                          const LabelID* l1, const LabelID* l2, EnergyTermType* costs) {
+			for ( SiteID k = 0; k < count; ++k )
+				costs[k] = compute(s1[k],s2[k],l1[k],l2[k]);
+		}
 	};
 
 	// Sets the cost of using label in the solution. 
@@ -245,6 +359,10 @@ public:
 	// This function can be used to change the label of any site at any time      
 	void setLabel(SiteID site, LabelID label);
 
+	// Restricts expansion and swap moves to the given sites; all other sites keep
+	// their current label. Passing count == 0 lets every site move again.
+	void setFreeSites(const SiteID* sites, SiteID count);
+
 	// setLabelOrder(false) sets the order to be not random; setLabelOrder(true) 
 	//	sets the order to random. By default, the labels are visited in non-random order 
 	//	for both the swap and alpha-expansion moves                         
@@ -271,6 +389,55 @@ public:
 	//   2 => expansion-/swap-level output (label(s), current energy)
 	void setVerbosity(int level) { m_verbosity = level; }
 
+	// Number of threads used to build and apply moves and to evaluate the energy.
+	// Smooth costs and data cost functions must then be safe to call concurrently;
+	// a DataCostFunctor only is if its threadSafe() says so, and sparse data costs,
+	// whose lookups move a shared search hint, are only read by one thread per label.
+	// Default is 1.
+	void setNumThreads(int numThreads);
+
+	// Keeps the graph of every move (one per label for expansion, one per label pair
+	// for swap) over all free sites, and when the move is repeated in a later cycle
+	// only updates the terms that changed and reuses its flow and search trees.
+	// Costs one graph per move; not available with label costs. Default is off.
+	void setGraphReuse(bool reuse);
+
+	// Runs the swaps of a cycle in rounds of label pairs with disjoint labels, whose moves
+	// change disjoint sites, on setNumThreads threads. The pairs of a round are solved on
+	// the labeling before the round; if together they raise the energy, the round is
+	// redone one pair after another. Ignored with graph reuse or label costs. Default is off.
+	void setParallelSwaps(bool parallel);
+
+	// When *flag becomes true, the running expansion/swap stops within one maxflow
+	// and throws GCException("Interrupted."); the labeling is left as it was before
+	// that move. The flag is owned by the caller and must outlive this object.
+	void setInterruptFlag(const std::atomic<bool>* flag);
+
+	// Solves moves with GridGraph (gridgraph.h), a maxflow for 4-connected grids that
+	// stores arcs implicitly, in about a third of the memory of the generic graph.
+	// Only for GCoptimizationGridGraph, and ignored with graph reuse or label costs,
+	// whose graphs are not grids. The grid spans the bounding box of the sites of a move,
+	// so moves sparser than GCO_MAX_GRID_SPARSITY use the generic graph. Default is off.
+	void setGridMaxflow(bool grid);
+
+	// Solves moves of at least GCO_MIN_PARALLEL_MAXFLOW_SITES sites with the parallel
+	// push-relabel of GridGraph on setNumThreads threads, which finds the same cut as
+	// the serial maxflow. Same conditions as setGridMaxflow, which it implies; the
+	// pairs of setParallelSwaps still run their maxflows serially. Default is off.
+	void setParallelMaxflow(bool parallel);
+
+	// Graphs of moves are taken from pool and given back to it when the move is done,
+	// also those kept by setGraphReuse when they are cleared. The pool must outlive
+	// this object. Default (or 0) is a pool owned by this object.
+	void setGraphPool(GraphPool* pool);
+
+	// Precision of the capacities in the graph of each move. GraphFloat and GraphInt32
+	// store them in 4 bytes instead of 8 (GraphDouble, the default), for smaller graphs.
+	// With GraphInt32 every term is multiplied by scale (rounded down to a power of 2, so
+	// that scaled energies compare exactly), rounded, and clamped to GCO_MAX_GRAPHTERM_INT32;
+	// terms that are clamped, e.g. hard constraints, must still dominate the others.
+	void setGraphPrecision(GraphPrecision precision, EnergyTermType scale = 1);
+
 protected:
 	struct LabelCost {
 		~LabelCost() { delete [] labels; }
@@ -306,6 +473,28 @@ protected:
 	int             m_labelcostCount;
 	bool            m_labelingInfoDirty;
 	int             m_verbosity;
+	int             m_numThreads;
+	SiteID*         m_freeSites;      // sorted sites allowed to change label, 0 if all are
+	SiteID          m_freeSitesCount;
+
+	// Graph of a move kept by setGraphReuse, with the capacities it was last built with
+	struct ReusedGraph {
+		EnergyT* e;
+		std::vector<EnergyTermType> trcap; // per variable
+		std::vector<EnergyTermType> rcap;  // per arc
+		ReusedGraph(): e(0) { }
+		~ReusedGraph() { delete e; } // e is normally given back to the pool before
+	};
+	bool                      m_graphReuse;
+	bool                      m_parallelSwaps;
+	GraphPrecision            m_graphPrecision;
+	EnergyTermType            m_graphScale;
+	const std::atomic<bool>*  m_interruptFlag;
+	bool                      m_gridMaxflow;
+	bool                      m_parallelMaxflow;
+	GraphPool                 m_ownGraphPool;
+	GraphPool*                m_graphPool;
+	std::vector<ReusedGraph*> m_reusedGraphs; // expansion: alpha, swap: (alpha+1)*m_num_labels+beta
 
 	void*   m_datacostFn;
 	void*   m_smoothcostFn;
@@ -329,6 +518,8 @@ protected:
 
 	// returns a pointer to the neighbors of a site and the weights
 	virtual void giveNeighborInfo(SiteID site, SiteID *numSites, SiteID **neighbors, EnergyTermType **weights)=0;
+	// Width of the grid of sites (site = y*width + x), 0 if sites are not a 4-connected grid
+	virtual SiteID gridWidth() const { return 0; }
 	virtual void finalizeNeighbors() = 0;
 
 	struct DataCostFnFromArray {
@@ -414,6 +605,8 @@ protected:
 
 		void           set(LabelID l, const SparseDataCost* costs, SiteID count);
 		EnergyTermType compute(SiteID s, LabelID l);
+		void           setDefault(EnergyTermType e) { m_default = e; }
+		EnergyTermType getDefault() const { return m_default; }
 		SiteID         queryActiveSitesExpansion(LabelID alpha_label, const LabelID* labeling, SiteID* activeSites);
 
 		class iterator {
@@ -440,15 +633,44 @@ protected:
 		const LabelID m_num_labels;
 		const int m_buckets_per_label;
 		mutable DataCostBucket* m_buckets;
+		EnergyTermType m_default; // cost of sites not listed for a label
 	};
 
 	template <typename DataCostT> SiteID queryActiveSitesExpansion(LabelID alpha_label, SiteID* activeSites);
+	SiteID queryFreeSitesExpansion(LabelID alpha_label, SiteID* activeSites);
+	SiteID queryMovableSites(SiteID* activeSites);
+	EnergyT* solveReused(size_t key, EnergyT* e, EnergyType* gain);
+	template <typename G> static EnergyType reuseGraph(ReusedGraph& g, G* kept, G* fresh, bool wantGain);
+	EnergyT* newMoveEnergy(int var_num_max, int edge_num_max, const SiteID* sites, SiteID numSites);
+	void releaseMoveEnergy(EnergyT* e);
+	void clearReusedGraphs();
 	template <typename DataCostT>   void setupDataCostsExpansion(SiteID size,LabelID alpha_label,EnergyT *e,SiteID *activeSites);
 	template <typename DataCostT>   void setupDataCostsSwap(SiteID size,LabelID alpha_label,LabelID beta_label,EnergyT *e,SiteID *activeSites);
 	template <typename SmoothCostT> void setupSmoothCostsExpansion(SiteID size,LabelID alpha_label,EnergyT *e,SiteID *activeSites);
+
+	// Smooth terms of a band of active sites, gathered so that their costs can be
+	// queried in one batch (possibly on another thread) and then added to the graph.
+	struct SmoothBatch {
+		struct Term { VarID i, j; EnergyTermType w; }; // j == -1 for a term with a fixed neighbor
+		std::vector<Term> terms;
+		std::vector<SiteID> s1, s2;
+		std::vector<LabelID> l1, l2;
+		std::vector<EnergyTermType> costs;
+		OLGA_INLINE void query(SiteID p, SiteID q, LabelID lp, LabelID lq) {
+			s1.push_back(p); s2.push_back(q); l1.push_back(lp); l2.push_back(lq);
+		}
+		void clear() { terms.clear(); s1.clear(); s2.clear(); l1.clear(); l2.clear(); }
+	};
+	template <typename SmoothCostT> void collectSmoothCostsExpansion(SmoothBatch& batch,SiteID begin,SiteID end,LabelID alpha_label,SiteID *activeSites);
+	template <typename SmoothCostT> static void computeSmoothBatch(SmoothCostT* sc, SmoothBatch& batch);
+	static void computeSmoothBatch(SmoothCostFunctor* sc, SmoothBatch& batch);
+	void addSmoothBatch(EnergyT *e, SmoothBatch& batch);
 	template <typename SmoothCostT> void setupSmoothCostsSwap(SiteID size,LabelID alpha_label,LabelID beta_label,EnergyT *e,SiteID *activeSites);
 	template <typename DataCostT>   void applyNewLabeling(EnergyT *e,SiteID *activeSites,SiteID size,LabelID alpha_label);
 	template <typename DataCostT>   void updateLabelingDataCosts();
+	template <typename DataCostT>   bool concurrentDataCosts() const;
+	bool moveImproves(EnergyType before, EnergyType after) const;
+	bool concurrentSwapDataCosts() const;
 	template <typename UserFunctor> void specializeDataCostFunctor(const UserFunctor f);
 	template <typename UserFunctor> void specializeSmoothCostFunctor(const UserFunctor f);
 
@@ -465,12 +687,16 @@ protected:
 	template <typename Functor> static void deleteFunctor(void* f) { delete reinterpret_cast<Functor*>(f); }
 
 	static void handleError(const char *message);
-	static void checkInterrupt();
+	void checkInterrupt();
 
 private:
 	// Peforms one iteration (one pass over all pairs of labels) of expansion/swap algorithm
 	EnergyType oneExpansionIteration();
 	EnergyType oneSwapIteration();
+	EnergyType oneParallelSwapIteration();
+	// alpha_beta_swap writing the new labels of the swapped sites to labeling,
+	// which is m_labeling except in oneParallelSwapIteration
+	void swapInto(LabelID alpha_label, LabelID beta_label, LabelID *labeling);
 	void printStatus1(const char* extraMsg=0);
 	void printStatus1(int cycle, bool isSwap, gcoclock_t ticks0);
 	void printStatus2(int alpha, int beta, int numVars, gcoclock_t ticks0);
@@ -514,6 +740,7 @@ private:
 		}
 		OLGA_INLINE EnergyTermType compute() const { return m_dc.compute(m_site,*m_label); }
 		OLGA_INLINE SiteID feasibleSites() const { return m_numSites; }
+		OLGA_INLINE EnergyTermType unlistedCost() const { return 0; }
 
 	private:
 		SiteID m_site;
@@ -541,6 +768,7 @@ public:
 protected:
 	virtual void giveNeighborInfo(SiteID site, SiteID *numSites, SiteID **neighbors, EnergyTermType **weights);
 	virtual void finalizeNeighbors();
+	virtual SiteID gridWidth() const { return m_width; }
 	EnergyTermType m_unityWeights[4];
 	int m_weightedGraph;  // true if spatially varying w_pq's are present. False otherwise.
 
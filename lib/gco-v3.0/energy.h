@@ -101,6 +101,10 @@ public:
 	/* Destructor */
 	~Energy();
 
+	/* Removes all variables and terms, keeping the memory
+	   (see Graph::reset() and Graph::reserve()) */
+	void reset();
+
 	/* Adds a new binary variable */
 	Var add_variable(int num=1);
 
@@ -193,6 +197,13 @@ inline Energy<captype,tcaptype,flowtype>::Energy(int var_num_max, int edge_num_m
 template <typename captype, typename tcaptype, typename flowtype> 
 inline Energy<captype,tcaptype,flowtype>::~Energy() {}
 
+template <typename captype, typename tcaptype, typename flowtype> 
+inline void Energy<captype,tcaptype,flowtype>::reset()
+{
+	GraphT::reset();
+	Econst = 0;
+}
+
 template <typename captype, typename tcaptype, typename flowtype> 
 inline typename Energy<captype,tcaptype,flowtype>::Var Energy<captype,tcaptype,flowtype>::add_variable(int num) 
 {	return GraphT::add_node(num); }
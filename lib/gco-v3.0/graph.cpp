@@ -11,7 +11,8 @@ template <typename captype, typename tcaptype, typename flowtype>
 	Graph<captype, tcaptype, flowtype>::Graph(int node_num_max, int edge_num_max, void (*err_function)(const char *))
 	: node_num(0),
 	  nodeptr_block(NULL),
-	  error_function(err_function)
+	  error_function(err_function),
+	  interrupt(NULL)
 {
 	if (node_num_max < 16) node_num_max = 16;
 	if (edge_num_max < 16) edge_num_max = 16;
@@ -48,16 +49,35 @@ template <typename captype, typename tcaptype, typename flowtype>
 	arc_last = arcs;
 	node_num = 0;
 
-	if (nodeptr_block) 
-	{ 
-		delete nodeptr_block; 
-		nodeptr_block = NULL; 
-	}
+	// nodeptr_block is kept: after maxflow() all its items are free
 
 	maxflow_iteration = 0;
 	flow = 0;
 }
 
+template <typename captype, typename tcaptype, typename flowtype> 
+	void Graph<captype,tcaptype,flowtype>::reserve(int node_num_max, int edge_num_max)
+{
+	if (node_num != 0 || arc_last != arcs) { if (error_function) (*error_function)("reserve() needs an empty graph!"); exit(1); }
+
+	if (node_num_max > node_max - nodes)
+	{
+		free(nodes);
+		nodes = (node*) malloc(node_num_max*sizeof(node));
+		if (!nodes) { if (error_function) (*error_function)("Not enough memory!"); exit(1); }
+		node_last = nodes;
+		node_max = nodes + node_num_max;
+	}
+	if (2*edge_num_max > arc_max - arcs)
+	{
+		free(arcs);
+		arcs = (arc*) malloc(2*edge_num_max*sizeof(arc));
+		if (!arcs) { if (error_function) (*error_function)("Not enough memory!"); exit(1); }
+		arc_last = arcs;
+		arc_max = arcs + 2*edge_num_max;
+	}
+}
+
 template <typename captype, typename tcaptype, typename flowtype> 
 	void Graph<captype,tcaptype,flowtype>::reallocate_nodes(int num)
 {
@@ -41,6 +41,7 @@
 
 #include <string.h>
 #include "block.h"
+#include <atomic>
 
 #include <assert.h>
 // NOTE: in UNIX you need to use -DNDEBUG preprocessor option to supress assert's!!!
@@ -107,6 +108,11 @@ public:
 	// FOR DESCRIPTION OF changed_list, SEE remove_from_changed_list().
 	flowtype maxflow(bool reuse_trees = false, Block<node_id>* changed_list = NULL);
 
+	// If *flag becomes true while maxflow() runs, it returns within a few
+	// hundred growth steps, leaving an incomplete flow. The graph must then be
+	// discarded (or reset), its cut and trees are meaningless.
+	void set_interrupt(const std::atomic<bool>* flag) { interrupt = flag; }
+
 	// After the maxflow is computed, this function returns to which
 	// segment the node 'i' belongs (Graph<captype,tcaptype,flowtype>::SOURCE or Graph<captype,tcaptype,flowtype>::SINK).
 	//
@@ -142,6 +148,12 @@ public:
 	// (see functions below).
 	void reset();
 
+	// Makes an empty graph (e.g. after reset()) hold node_num_max nodes and
+	// edge_num_max edges without reallocation. Memory is never given back before
+	// the destructor, so a graph that is reset and reused keeps the size of the
+	// largest graph it held.
+	void reserve(int node_num_max, int edge_num_max);
+
 	////////////////////////////////////////////////////////////////////////////////
 	// 2. Functions for getting pointers to arcs and for reading graph structure. //
 	//    NOTE: adding new arcs may invalidate these pointers (if reallocation    //
@@ -310,6 +322,8 @@ private:
 	int					maxflow_iteration; // counter
 	Block<node_id>		*changed_list;
 
+	const std::atomic<bool>	*interrupt; // see set_interrupt()
+
 	/////////////////////////////////////////////////////////////////////////
 
 	node				*queue_first[2], *queue_last[2];	// list of active nodes
@@ -0,0 +1,1030 @@
+/* gridgraph.h */
+/*
+	Maxflow on a 4-connected grid, with the algorithm of graph.h / maxflow.cpp
+	(Boykov & Kolmogorov, "An Experimental Comparison of Min-Cut/Max-Flow
+	Algorithms for Energy Minimization in Vision", PAMI 2004).
+
+	Compared to Graph, arcs are implicit: a node stores the residual capacities
+	of the arcs to its 4 neighbors, so there are no arc structs and no 'next' or
+	'sister' pointers to chase. Nodes are laid out in 8x8 blocks, so that the
+	trees, which grow between neighbors, mostly stay in nearby memory, and they
+	refer to each other by int32 indices. A node takes 64 bytes with double
+	capacities and 36 with float or int, against about 3 times as much for
+	Graph with its arcs.
+
+	With set_threads(), maxflow() runs a parallel push-relabel instead, with the
+	blocks as regions (Delong & Boykov, "A Scalable Graph-Cut Algorithm for N-D
+	Grids", CVPR 2008): a block discharges its nodes on its own, pushing also to
+	the nodes around it. Blocks are colored by the parity of their column and row,
+	and the blocks of one color are discharged in parallel, as no node is next to
+	two of them. The cut is then read as in maxflow.cpp: nodes that can reach the
+	sink in the residual graph are SINK, so both algorithms return the same cut.
+
+	GridEnergy is the counterpart of Energy (energy.h) for variables that are
+	sites of a grid, e.g. the sites of an expansion or swap move of
+	GCoptimizationGridGraph; terms of two variables must join grid neighbors.
+*/
+
+#ifndef __GRIDGRAPH_H__
+#define __GRIDGRAPH_H__
+
+#include <vector>
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+// captype: type of edge capacities (excluding t-links)
+// tcaptype: type of t-links (edges between nodes and terminals)
+// flowtype: type of total flow
+template <typename captype, typename tcaptype, typename flowtype> class GridGraph
+{
+public:
+	typedef enum
+	{
+		SOURCE	= 0,
+		SINK	= 1
+	} termtype; // terminals
+	typedef int node_id;
+
+	// Directions of the 4 arcs of a node; the reverse of arc d is arc (d ^ 2) of the neighbor.
+	enum { RIGHT = 0, DOWN = 1, LEFT = 2, UP = 3 };
+
+	GridGraph(void (*err_function)(const char *) = NULL);
+
+	// Removes all nodes and edges and makes a grid of width x height nodes,
+	// all with zero capacities. Memory is kept for the next reset().
+	void reset(int width, int height);
+
+	// Id of the node at (x, y)
+	node_id node_at(int x, int y) const
+	{
+		return (((y >> 3)*blocks_per_row + (x >> 3)) << 6) + ((y & 7) << 3) + (x & 7);
+	}
+
+	// Adds the edges from node 'i' to its neighbor in direction 'dir' and back,
+	// with the weights 'cap' and 'rev_cap'. May be called several times.
+	void add_edge(node_id i, int dir, captype cap, captype rev_cap);
+
+	// Adds new edges 'SOURCE->i' and 'i->SINK' with corresponding weights,
+	// as Graph::add_tweights().
+	void add_tweights(node_id i, tcaptype cap_source, tcaptype cap_sink);
+
+	// Computes the maxflow. Can be called once after reset().
+	flowtype maxflow();
+
+	// Threads of maxflow(): with more than 1, and unless called from a parallel region,
+	// it runs the parallel push-relabel. Default is 1.
+	void set_threads(int num_threads) { threads = num_threads; }
+
+	// See Graph::set_interrupt()
+	void set_interrupt(const std::atomic<bool>* flag) { interrupt = flag; }
+
+	// See Graph::what_segment()
+	termtype what_segment(node_id i, termtype default_segm = SOURCE);
+
+	// Number of edges added so far, as Graph::get_arc_num()/2
+	int get_edge_num() const { return edge_num; }
+
+private:
+	// special values of node::parent, other values are the direction of the arc to the parent
+	enum { PARENT_NONE = 4, PARENT_TERMINAL = 5, PARENT_ORPHAN = 6 };
+
+	static const int INFINITE_DIST = (int)(((unsigned)-1)/2); // infinite distance to the terminal
+
+	struct node
+	{
+		node_id			next;		// next active node (itself if it is the last one), -1 if not active
+		int				TS;			// timestamp showing when DIST was computed
+		int				DIST;		// distance to the terminal
+		tcaptype		tr_cap;		// if tr_cap > 0 then tr_cap is residual capacity of the arc SOURCE->node
+									// otherwise         -tr_cap is residual capacity of the arc node->SINK
+		captype			r_cap[4];	// residual capacities of the arcs to the neighbors
+		unsigned char	parent;		// direction of the arc to the parent, or PARENT_NONE, PARENT_TERMINAL, PARENT_ORPHAN
+		unsigned char	is_sink;	// flag showing whether the node is in the source or in the sink tree (if parent!=PARENT_NONE)
+		unsigned char	arcs;		// bit d is set if the arc in direction d was added
+	};
+
+	std::vector<node>	nodes;
+	int					blocks_per_row;
+	int					edge_num;
+	flowtype			flow;		// total flow
+
+	void	(*error_function)(const char *);	// this function is called if a error occurs,
+										// with a corresponding error message
+										// (or exit(1) is called if it's NULL)
+	const std::atomic<bool>	*interrupt; // see set_interrupt()
+
+	node_id				queue_first[2], queue_last[2];	// list of active nodes
+	std::vector<node_id> orphan_front;	// orphans found by augment(), the last one first
+	std::vector<node_id> orphan_rear;	// orphans found while adopting, in order
+	size_t				orphan_rear_first;
+	int					TIME;			// monotonically increasing global counter
+
+	// Offsets to the neighbor in each direction, within a block and into the next block;
+	// the next block is taken when (i & edge_mask[d]) == edge_bits[d]
+	node_id inner_step[4], outer_step[4];
+	static const int edge_mask[4], edge_bits[4];
+
+	// push-relabel: node::DIST is the height, and tr_cap > 0 is the excess
+	// (the arc SOURCE->node is saturated at once)
+	int					threads;
+	std::vector<unsigned char> block_active;	// 1 if the block has active nodes, other values while sweeping
+	std::vector<int>	active_blocks, color_blocks[4], changed_blocks;
+	std::vector<node_id> bfs_queue;
+
+	// Neighbor of node 'i' in direction 'dir', which must exist
+	node_id neighbor(node_id i, int dir) const
+	{
+		return i + ((i & edge_mask[dir]) == edge_bits[dir] ? outer_step[dir] : inner_step[dir]);
+	}
+
+	void set_active(node_id i);
+	node_id next_active();
+	void set_orphan_front(node_id i);
+	void set_orphan_rear(node_id i);
+
+	void maxflow_init();
+	void augment(node_id middle, int middle_dir);
+	void process_source_orphan(node_id i);
+	void process_sink_orphan(node_id i);
+
+	flowtype maxflow_push_relabel();
+	void global_relabel();
+	void find_active_blocks();
+	void blocks_around(int b, int around[5]) const;
+	flowtype discharge_block(int b, int& relabels);
+};
+
+
+// Energy of binary variables that are sites of a grid, see Energy (energy.h).
+template <typename captype, typename tcaptype, typename flowtype> class GridEnergy: public GridGraph<captype,tcaptype,flowtype>
+{
+	typedef GridGraph<captype,tcaptype,flowtype> GraphT;
+public:
+	typedef int Var;
+	typedef captype Value;
+	typedef flowtype TotalValue;
+
+	GridEnergy(void (*err_function)(const char *) = NULL)
+		: GraphT(err_function), sites(NULL), grid_width(0), var_num(0), Econst(0), error_function(err_function) { }
+
+	// Removes all variables and terms. Variable k will be site sites[k] of a grid
+	// that is grid_width sites wide (site = y*grid_width + x); the graph spans the
+	// bounding box of the sites. 'sites' must stay valid while variables are used.
+	void reset(const int* sites, int count, int grid_width);
+
+	// Bounding box [x0,x1] x [y0,y1] of the sites, the graph of reset() has a node
+	// for each of its pixels, used or not
+	static void bounding_box(const int* sites, int count, int grid_width, int& x0, int& y0, int& x1, int& y1);
+
+	Var add_variable(int num=1)
+	{
+		Var first = var_num;
+		var_num += num;
+		if (var_num > (int)nodes_of_vars.size()) { if (error_function) (*error_function)("Too many variables for the grid sites!"); exit(1); }
+		return first;
+	}
+	void add_constant(Value E) { Econst += E; }
+	void add_tweights(Var x, tcaptype cap_source, tcaptype cap_sink) { GraphT::add_tweights(nodes_of_vars[x], cap_source, cap_sink); }
+	void add_edge(Var x, Var y, captype cap, captype rev_cap) { GraphT::add_edge(nodes_of_vars[x], direction(x, y), cap, rev_cap); }
+	void add_term1(Var x, Value E0, Value E1) { add_tweights(x, E1, E0); }
+	void add_term2(Var x, Var y, Value E00, Value E01, Value E10, Value E11);
+	TotalValue minimize() { return Econst + GraphT::maxflow(); }
+	int get_var(Var x) { return (int) GraphT::what_segment(nodes_of_vars[x]); }
+	int get_node_num() const { return var_num; }
+
+private:
+	const int*			sites;
+	int					grid_width;
+	int					var_num;
+	std::vector<int>	nodes_of_vars;
+	TotalValue			Econst;
+	void				(*error_function)(const char *);
+
+	// Direction from variable x to variable y, which must be grid neighbors
+	int direction(Var x, Var y) const
+	{
+		int d = sites[y] - sites[x];
+		if (d == grid_width)	return GraphT::DOWN;
+		if (d == -grid_width)	return GraphT::UP;
+		if (d == 1)				return GraphT::RIGHT;
+		assert(d == -1);
+		return GraphT::LEFT;
+	}
+};
+
+
+/***********************************************************************/
+/************************  Implementation ******************************/
+/***********************************************************************/
+
+template <typename captype, typename tcaptype, typename flowtype>
+	const int GridGraph<captype,tcaptype,flowtype>::edge_mask[4] = { 7, 56, 7, 56 };
+template <typename captype, typename tcaptype, typename flowtype>
+	const int GridGraph<captype,tcaptype,flowtype>::edge_bits[4] = { 7, 56, 0, 0 };
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline GridGraph<captype,tcaptype,flowtype>::GridGraph(void (*err_function)(const char *))
+	: blocks_per_row(0),
+	  edge_num(0),
+	  flow(0),
+	  error_function(err_function),
+	  interrupt(NULL),
+	  orphan_rear_first(0),
+	  TIME(0),
+	  threads(1)
+{
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline void GridGraph<captype,tcaptype,flowtype>::reset(int width, int height)
+{
+	blocks_per_row = (width + 7) >> 3;
+	int block_rows = (height + 7) >> 3;
+	int block_row_step = blocks_per_row << 6;
+	inner_step[RIGHT] = 1;  outer_step[RIGHT] = 64 - 7;
+	inner_step[DOWN]  = 8;  outer_step[DOWN]  = block_row_step - 56;
+	inner_step[LEFT]  = -1; outer_step[LEFT]  = -64 + 7;
+	inner_step[UP]    = -8; outer_step[UP]    = -block_row_step + 56;
+
+	node zero;
+	memset(&zero, 0, sizeof(node));
+	zero.next = -1;
+	zero.parent = PARENT_NONE;
+	nodes.assign((size_t)blocks_per_row*block_rows*64, zero);
+
+	edge_num = 0;
+	flow = 0;
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline void GridGraph<captype,tcaptype,flowtype>::add_edge(node_id i, int dir, captype cap, captype rev_cap)
+{
+	assert(cap >= 0 && rev_cap >= 0);
+	node_id j = neighbor(i, dir);
+	nodes[i].r_cap[dir] += cap;
+	nodes[i].arcs |= 1 << dir;
+	nodes[j].r_cap[dir ^ 2] += rev_cap;
+	nodes[j].arcs |= 1 << (dir ^ 2);
+	edge_num ++;
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline void GridGraph<captype,tcaptype,flowtype>::add_tweights(node_id i, tcaptype cap_source, tcaptype cap_sink)
+{
+	tcaptype delta = nodes[i].tr_cap;
+	if (delta > 0) cap_source += delta;
+	else           cap_sink   -= delta;
+	flow += (cap_source < cap_sink) ? cap_source : cap_sink;
+	nodes[i].tr_cap = cap_source - cap_sink;
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline typename GridGraph<captype,tcaptype,flowtype>::termtype GridGraph<captype,tcaptype,flowtype>::what_segment(node_id i, termtype default_segm)
+{
+	if (nodes[i].parent != PARENT_NONE)
+	{
+		return (nodes[i].is_sink) ? SINK : SOURCE;
+	}
+	else
+	{
+		return default_segm;
+	}
+}
+
+/***********************************************************************/
+
+// Active nodes are kept in two queues as in maxflow.cpp, linked by node::next.
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline void GridGraph<captype,tcaptype,flowtype>::set_active(node_id i)
+{
+	if (nodes[i].next < 0)
+	{
+		/* it's not in the list yet */
+		if (queue_last[1] >= 0) nodes[queue_last[1]].next = i;
+		else                    queue_first[1]            = i;
+		queue_last[1] = i;
+		nodes[i].next = i;
+	}
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline typename GridGraph<captype,tcaptype,flowtype>::node_id GridGraph<captype,tcaptype,flowtype>::next_active()
+{
+	node_id i;
+
+	while ( 1 )
+	{
+		if ((i=queue_first[0]) < 0)
+		{
+			queue_first[0] = i = queue_first[1];
+			queue_last[0]  = queue_last[1];
+			queue_first[1] = -1;
+			queue_last[1]  = -1;
+			if (i < 0) return -1;
+		}
+
+		/* remove it from the active list */
+		if (nodes[i].next == i) queue_first[0] = queue_last[0] = -1;
+		else                    queue_first[0] = nodes[i].next;
+		nodes[i].next = -1;
+
+		/* a node in the list is active iff it has a parent */
+		if (nodes[i].parent != PARENT_NONE) return i;
+	}
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline void GridGraph<captype,tcaptype,flowtype>::set_orphan_front(node_id i)
+{
+	nodes[i].parent = PARENT_ORPHAN;
+	orphan_front.push_back(i);
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline void GridGraph<captype,tcaptype,flowtype>::set_orphan_rear(node_id i)
+{
+	nodes[i].parent = PARENT_ORPHAN;
+	orphan_rear.push_back(i);
+}
+
+/***********************************************************************/
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline void GridGraph<captype,tcaptype,flowtype>::maxflow_init()
+{
+	queue_first[0] = queue_last[0] = -1;
+	queue_first[1] = queue_last[1] = -1;
+	orphan_front.clear();
+	orphan_rear.clear();
+	orphan_rear_first = 0;
+
+	TIME = 0;
+
+	for (node_id i=0; i<(node_id)nodes.size(); i++)
+	{
+		node& n = nodes[i];
+		n.next = -1;
+		n.TS = TIME;
+		if (n.tr_cap > 0)
+		{
+			/* i is connected to the source */
+			n.is_sink = 0;
+			n.parent = PARENT_TERMINAL;
+			set_active(i);
+			n.DIST = 1;
+		}
+		else if (n.tr_cap < 0)
+		{
+			/* i is connected to the sink */
+			n.is_sink = 1;
+			n.parent = PARENT_TERMINAL;
+			set_active(i);
+			n.DIST = 1;
+		}
+		else
+		{
+			n.parent = PARENT_NONE;
+		}
+	}
+}
+
+// The middle arc goes from 'middle' (source tree) in direction 'middle_dir' (to the sink tree).
+template <typename captype, typename tcaptype, typename flowtype>
+	void GridGraph<captype,tcaptype,flowtype>::augment(node_id middle, int middle_dir)
+{
+	node_id i, j;
+	int d;
+	tcaptype bottleneck;
+	node_id middle_head = neighbor(middle, middle_dir);
+
+	/* 1. Finding bottleneck capacity */
+	/* 1a - the source tree */
+	bottleneck = nodes[middle].r_cap[middle_dir];
+	for (i=middle; ; i=j)
+	{
+		d = nodes[i].parent;
+		if (d == PARENT_TERMINAL) break;
+		j = neighbor(i, d);
+		if (bottleneck > nodes[j].r_cap[d ^ 2]) bottleneck = nodes[j].r_cap[d ^ 2];
+	}
+	if (bottleneck > nodes[i].tr_cap) bottleneck = nodes[i].tr_cap;
+	/* 1b - the sink tree */
+	for (i=middle_head; ; i=j)
+	{
+		d = nodes[i].parent;
+		if (d == PARENT_TERMINAL) break;
+		j = neighbor(i, d);
+		if (bottleneck > nodes[i].r_cap[d]) bottleneck = nodes[i].r_cap[d];
+	}
+	if (bottleneck > - nodes[i].tr_cap) bottleneck = - nodes[i].tr_cap;
+
+
+	/* 2. Augmenting */
+	/* 2a - the source tree */
+	nodes[middle_head].r_cap[middle_dir ^ 2] += bottleneck;
+	nodes[middle].r_cap[middle_dir] -= bottleneck;
+	for (i=middle; ; i=j)
+	{
+		d = nodes[i].parent;
+		if (d == PARENT_TERMINAL) break;
+		j = neighbor(i, d);
+		nodes[i].r_cap[d] += bottleneck;
+		nodes[j].r_cap[d ^ 2] -= bottleneck;
+		if (!nodes[j].r_cap[d ^ 2])
+		{
+			set_orphan_front(i); // add i to the beginning of the adoption list
+		}
+	}
+	nodes[i].tr_cap -= bottleneck;
+	if (!nodes[i].tr_cap)
+	{
+		set_orphan_front(i); // add i to the beginning of the adoption list
+	}
+	/* 2b - the sink tree */
+	for (i=middle_head; ; i=j)
+	{
+		d = nodes[i].parent;
+		if (d == PARENT_TERMINAL) break;
+		j = neighbor(i, d);
+		nodes[j].r_cap[d ^ 2] += bottleneck;
+		nodes[i].r_cap[d] -= bottleneck;
+		if (!nodes[i].r_cap[d])
+		{
+			set_orphan_front(i); // add i to the beginning of the adoption list
+		}
+	}
+	nodes[i].tr_cap += bottleneck;
+	if (!nodes[i].tr_cap)
+	{
+		set_orphan_front(i); // add i to the beginning of the adoption list
+	}
+
+
+	flow += bottleneck;
+}
+
+/***********************************************************************/
+
+template <typename captype, typename tcaptype, typename flowtype>
+	void GridGraph<captype,tcaptype,flowtype>::process_source_orphan(node_id i)
+{
+	node_id j;
+	int d0, d0_min = PARENT_NONE, a;
+	int d, d_min = INFINITE_DIST;
+
+	/* trying to find a new parent */
+	for (d0=0; d0<4; d0++)
+	if ((nodes[i].arcs >> d0 & 1) && nodes[j = neighbor(i, d0)].r_cap[d0 ^ 2])
+	{
+		if (!nodes[j].is_sink && (a=nodes[j].parent) != PARENT_NONE)
+		{
+			/* checking the origin of j */
+			d = 0;
+			while ( 1 )
+			{
+				if (nodes[j].TS == TIME)
+				{
+					d += nodes[j].DIST;
+					break;
+				}
+				a = nodes[j].parent;
+				d ++;
+				if (a==PARENT_TERMINAL)
+				{
+					nodes[j].TS = TIME;
+					nodes[j].DIST = 1;
+					break;
+				}
+				if (a==PARENT_ORPHAN) { d = INFINITE_DIST; break; }
+				j = neighbor(j, a);
+			}
+			if (d<INFINITE_DIST) /* j originates from the source - done */
+			{
+				if (d<d_min)
+				{
+					d0_min = d0;
+					d_min = d;
+				}
+				/* set marks along the path */
+				for (j=neighbor(i, d0); nodes[j].TS!=TIME; j=neighbor(j, nodes[j].parent))
+				{
+					nodes[j].TS = TIME;
+					nodes[j].DIST = d --;
+				}
+			}
+		}
+	}
+
+	if ((nodes[i].parent = d0_min) != PARENT_NONE)
+	{
+		nodes[i].TS = TIME;
+		nodes[i].DIST = d_min + 1;
+	}
+	else
+	{
+		/* no parent is found, process neighbors */
+		for (d0=0; d0<4; d0++)
+		if (nodes[i].arcs >> d0 & 1)
+		{
+			j = neighbor(i, d0);
+			if (!nodes[j].is_sink && (a=nodes[j].parent) != PARENT_NONE)
+			{
+				if (nodes[j].r_cap[d0 ^ 2]) set_active(j);
+				if (a == (d0 ^ 2))
+				{
+					set_orphan_rear(j); // add j to the end of the adoption list
+				}
+			}
+		}
+	}
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	void GridGraph<captype,tcaptype,flowtype>::process_sink_orphan(node_id i)
+{
+	node_id j;
+	int d0, d0_min = PARENT_NONE, a;
+	int d, d_min = INFINITE_DIST;
+
+	/* trying to find a new parent */
+	for (d0=0; d0<4; d0++)
+	if ((nodes[i].arcs >> d0 & 1) && nodes[i].r_cap[d0])
+	{
+		j = neighbor(i, d0);
+		if (nodes[j].is_sink && (a=nodes[j].parent) != PARENT_NONE)
+		{
+			/* checking the origin of j */
+			d = 0;
+			while ( 1 )
+			{
+				if (nodes[j].TS == TIME)
+				{
+					d += nodes[j].DIST;
+					break;
+				}
+				a = nodes[j].parent;
+				d ++;
+				if (a==PARENT_TERMINAL)
+				{
+					nodes[j].TS = TIME;
+					nodes[j].DIST = 1;
+					break;
+				}
+				if (a==PARENT_ORPHAN) { d = INFINITE_DIST; break; }
+				j = neighbor(j, a);
+			}
+			if (d<INFINITE_DIST) /* j originates from the sink - done */
+			{
+				if (d<d_min)
+				{
+					d0_min = d0;
+					d_min = d;
+				}
+				/* set marks along the path */
+				for (j=neighbor(i, d0); nodes[j].TS!=TIME; j=neighbor(j, nodes[j].parent))
+				{
+					nodes[j].TS = TIME;
+					nodes[j].DIST = d --;
+				}
+			}
+		}
+	}
+
+	if ((nodes[i].parent = d0_min) != PARENT_NONE)
+	{
+		nodes[i].TS = TIME;
+		nodes[i].DIST = d_min + 1;
+	}
+	else
+	{
+		/* no parent is found, process neighbors */
+		for (d0=0; d0<4; d0++)
+		if (nodes[i].arcs >> d0 & 1)
+		{
+			j = neighbor(i, d0);
+			if (nodes[j].is_sink && (a=nodes[j].parent) != PARENT_NONE)
+			{
+				if (nodes[i].r_cap[d0]) set_active(j);
+				if (a == (d0 ^ 2))
+				{
+					set_orphan_rear(j); // add j to the end of the adoption list
+				}
+			}
+		}
+	}
+}
+
+/***********************************************************************/
+
+template <typename captype, typename tcaptype, typename flowtype>
+	flowtype GridGraph<captype,tcaptype,flowtype>::maxflow()
+{
+	node_id i, j, current_node = -1;
+	int d;
+
+#ifdef _OPENMP
+	if (threads > 1 && !omp_in_parallel()) return maxflow_push_relabel();
+#endif
+
+	maxflow_init();
+
+	// main loop
+	while ( 1 )
+	{
+		if ((i=current_node) >= 0)
+		{
+			nodes[i].next = -1; /* remove active flag */
+			if (nodes[i].parent == PARENT_NONE) i = -1;
+		}
+		if (i < 0)
+		{
+			if ((i = next_active()) < 0) break;
+		}
+
+		// the middle arc goes from 'middle' in direction 'middle_dir', if one is found
+		node_id middle = -1;
+		int middle_dir = 0;
+		node& n = nodes[i];
+
+		/* growth */
+		if (!n.is_sink)
+		{
+			/* grow source tree */
+			for (d=0; d<4; d++)
+			if (n.r_cap[d])
+			{
+				j = neighbor(i, d);
+				node& m = nodes[j];
+				if (m.parent == PARENT_NONE)
+				{
+					m.is_sink = 0;
+					m.parent = d ^ 2;
+					m.TS = n.TS;
+					m.DIST = n.DIST + 1;
+					set_active(j);
+				}
+				else if (m.is_sink) { middle = i; middle_dir = d; break; }
+				else if (m.TS <= n.TS &&
+				         m.DIST > n.DIST)
+				{
+					/* heuristic - trying to make the distance from j to the source shorter */
+					m.parent = d ^ 2;
+					m.TS = n.TS;
+					m.DIST = n.DIST + 1;
+				}
+			}
+		}
+		else
+		{
+			/* grow sink tree */
+			for (d=0; d<4; d++)
+			if ((n.arcs >> d & 1) && nodes[j = neighbor(i, d)].r_cap[d ^ 2])
+			{
+				node& m = nodes[j];
+				if (m.parent == PARENT_NONE)
+				{
+					m.is_sink = 1;
+					m.parent = d ^ 2;
+					m.TS = n.TS;
+					m.DIST = n.DIST + 1;
+					set_active(j);
+				}
+				else if (!m.is_sink) { middle = j; middle_dir = d ^ 2; break; }
+				else if (m.TS <= n.TS &&
+				         m.DIST > n.DIST)
+				{
+					/* heuristic - trying to make the distance from j to the sink shorter */
+					m.parent = d ^ 2;
+					m.TS = n.TS;
+					m.DIST = n.DIST + 1;
+				}
+			}
+		}
+
+		TIME ++;
+		if ((TIME & 255) == 0 && interrupt && interrupt->load(std::memory_order_relaxed)) break;
+
+		if (middle >= 0)
+		{
+			nodes[i].next = i; /* set active flag */
+			current_node = i;
+
+			/* augmentation */
+			augment(middle, middle_dir);
+			/* augmentation end */
+
+			/* adoption */
+			while (!orphan_front.empty())
+			{
+				i = orphan_front.back();
+				orphan_front.pop_back();
+				if (nodes[i].is_sink) process_sink_orphan(i);
+				else                  process_source_orphan(i);
+
+				while (orphan_rear_first < orphan_rear.size())
+				{
+					i = orphan_rear[orphan_rear_first++];
+					if (nodes[i].is_sink) process_sink_orphan(i);
+					else                  process_source_orphan(i);
+				}
+				orphan_rear.clear();
+				orphan_rear_first = 0;
+			}
+			/* adoption end */
+		}
+		else current_node = -1;
+	}
+
+	return flow;
+}
+
+/***********************************************************************/
+
+// Heights become the distances to the sink in the residual graph, INFINITE_DIST
+// for nodes that can not reach it; the sink is at 0.
+template <typename captype, typename tcaptype, typename flowtype>
+	void GridGraph<captype,tcaptype,flowtype>::global_relabel()
+{
+	bfs_queue.clear();
+	for (node_id i=0; i<(node_id)nodes.size(); i++)
+	{
+		if (nodes[i].tr_cap < 0)
+		{
+			nodes[i].DIST = 1;
+			bfs_queue.push_back(i);
+		}
+		else nodes[i].DIST = INFINITE_DIST;
+	}
+	for (size_t k=0; k<bfs_queue.size(); k++)
+	{
+		node_id i = bfs_queue[k];
+		for (int d=0; d<4; d++)
+		{
+			if (!(nodes[i].arcs & (1 << d))) continue;
+			node_id j = neighbor(i, d);
+			if (nodes[j].DIST == INFINITE_DIST && nodes[j].r_cap[d ^ 2])
+			{
+				nodes[j].DIST = nodes[i].DIST + 1;
+				bfs_queue.push_back(j);
+			}
+		}
+	}
+}
+
+// Active nodes have excess and can reach the sink
+template <typename captype, typename tcaptype, typename flowtype>
+	void GridGraph<captype,tcaptype,flowtype>::find_active_blocks()
+{
+	active_blocks.clear();
+	for (int b=0; b<(int)block_active.size(); b++)
+	{
+		block_active[b] = 0;
+		for (node_id i=b<<6; i<(b+1)<<6; i++)
+			if (nodes[i].tr_cap > 0 && nodes[i].DIST < INFINITE_DIST) { block_active[b] = 1; break; }
+		if (block_active[b]) active_blocks.push_back(b);
+	}
+}
+
+// Block 'b' and the blocks next to it, -1 past the borders
+template <typename captype, typename tcaptype, typename flowtype>
+	inline void GridGraph<captype,tcaptype,flowtype>::blocks_around(int b, int around[5]) const
+{
+	int bx = b % blocks_per_row, by = b / blocks_per_row;
+	int block_rows = (int)(nodes.size() >> 6) / blocks_per_row;
+	around[0] = b;
+	around[1] = bx+1 < blocks_per_row ? b+1 : -1;
+	around[2] = by+1 < block_rows ? b+blocks_per_row : -1;
+	around[3] = bx > 0 ? b-1 : -1;
+	around[4] = by > 0 ? b-blocks_per_row : -1;
+}
+
+// Discharges the nodes of block 'b' in FIFO order, pushing also to the nodes around it;
+// stops early after some relabels, as heights of nodes whose excess can not leave
+// only grow until the next global relabel. Returns the flow that reached the sink.
+template <typename captype, typename tcaptype, typename flowtype>
+	flowtype GridGraph<captype,tcaptype,flowtype>::discharge_block(int b, int& relabels)
+{
+	const node_id first = b << 6;
+	const int node_num = (int)nodes.size();
+	flowtype sunk = 0;
+	node_id queue[64];
+	unsigned long long queued = 0;
+	int head = 0, count = 0;
+
+	for (node_id i=first; i<first+64; i++)
+		if (nodes[i].tr_cap > 0 && nodes[i].DIST < INFINITE_DIST)
+		{
+			queue[count++] = i;
+			queued |= 1ULL << (i - first);
+		}
+
+	for (relabels=0; count && relabels<4*64; )
+	{
+		node_id i = queue[head];
+		head = (head + 1) & 63;
+		count --;
+		queued &= ~(1ULL << (i - first));
+		node& n = nodes[i];
+
+		while ( 1 )
+		{
+			/* push */
+			for (int d=0; d<4 && n.tr_cap > 0; d++)
+			{
+				if (!n.r_cap[d]) continue;
+				node_id j = neighbor(i, d);
+				node& m = nodes[j];
+				if (m.DIST != n.DIST - 1) continue;
+				captype f = (n.tr_cap < n.r_cap[d]) ? (captype)n.tr_cap : n.r_cap[d];
+				n.r_cap[d] -= f;
+				m.r_cap[d ^ 2] += f;
+				n.tr_cap -= f;
+				if (m.tr_cap < 0) sunk += (f < -m.tr_cap) ? f : -m.tr_cap;
+				m.tr_cap += f;
+				if (m.tr_cap > 0 && (j >> 6) == b && !(queued & (1ULL << (j - first))))
+				{
+					queue[(head + count) & 63] = j;
+					count ++;
+					queued |= 1ULL << (j - first);
+				}
+			}
+			if (n.tr_cap <= 0) break;
+
+			/* relabel */
+			int h = INFINITE_DIST;
+			for (int d=0; d<4; d++)
+				if (n.r_cap[d] && nodes[neighbor(i, d)].DIST < h - 1) h = nodes[neighbor(i, d)].DIST + 1;
+			n.DIST = (h > node_num) ? INFINITE_DIST : h;
+			relabels ++;
+			if (n.DIST == INFINITE_DIST) break;
+		}
+	}
+
+	return sunk;
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	flowtype GridGraph<captype,tcaptype,flowtype>::maxflow_push_relabel()
+{
+	const node_id node_num = (node_id)nodes.size();
+	const int block_num = node_num >> 6;
+	long long relabels = 0; // since the last global relabel
+	int around[5];
+
+	block_active.assign(block_num, 0);
+	global_relabel();
+	find_active_blocks();
+
+	while (!active_blocks.empty())
+	{
+		if (interrupt && interrupt->load(std::memory_order_relaxed)) break;
+
+		/* blocks that may get excess in the sweep: the active ones and their neighbors;
+		   block_active is 2 for blocks in color_blocks */
+		for (int c=0; c<4; c++) color_blocks[c].clear();
+		for (size_t k=0; k<active_blocks.size(); k++)
+		{
+			blocks_around(active_blocks[k], around);
+			for (int a=0; a<5; a++)
+			{
+				int b = around[a];
+				if (b < 0 || block_active[b] == 2) continue;
+				if (block_active[b] == 1 && a > 0) continue; // added as an active block
+				block_active[b] = 2;
+				color_blocks[((b % blocks_per_row) & 1) | (((b / blocks_per_row) & 1) << 1)].push_back(b);
+			}
+		}
+
+		flowtype sunk = 0;
+		long long relabeled = 0;
+		#pragma omp parallel num_threads(threads)
+		for (int c=0; c<4; c++)
+		{
+			const int num = (int)color_blocks[c].size();
+			#pragma omp for schedule(dynamic) reduction(+:sunk,relabeled)
+			for (int k=0; k<num; k++)
+			{
+				int block_relabels;
+				sunk += discharge_block(color_blocks[c][k], block_relabels);
+				relabeled += block_relabels;
+			}
+		}
+		flow += sunk;
+		relabels += relabeled;
+
+		/* heights drift from the distances after many relabels, and excess that can not
+		   reach the sink climbs slowly; the distances are then computed again */
+		if (relabels >= node_num/4)
+		{
+			global_relabel();
+			find_active_blocks();
+			relabels = 0;
+			continue;
+		}
+
+		/* swept blocks also pushed to their neighbors, whatever their color */
+		changed_blocks.clear();
+		for (int c=0; c<4; c++)
+			for (size_t k=0; k<color_blocks[c].size(); k++)
+			{
+				blocks_around(color_blocks[c][k], around);
+				for (int a=0; a<5; a++)
+					if (around[a] >= 0 && block_active[around[a]] != 3)
+					{
+						block_active[around[a]] = 3;
+						changed_blocks.push_back(around[a]);
+					}
+			}
+		active_blocks.clear();
+		for (size_t k=0; k<changed_blocks.size(); k++)
+		{
+			int b = changed_blocks[k];
+			block_active[b] = 0;
+			for (node_id i=b<<6; i<(b+1)<<6; i++)
+				if (nodes[i].tr_cap > 0 && nodes[i].DIST < INFINITE_DIST) { block_active[b] = 1; break; }
+			if (block_active[b]) active_blocks.push_back(b);
+		}
+	}
+
+	/* the excess that is left can not reach the sink, so the nodes that can are the
+	   sink side of the minimum cut, the same nodes as the sink tree of maxflow() */
+	global_relabel();
+	for (node_id i=0; i<node_num; i++)
+	{
+		nodes[i].is_sink = 1;
+		nodes[i].parent = (nodes[i].DIST < INFINITE_DIST) ? PARENT_TERMINAL : PARENT_NONE;
+	}
+
+	return flow;
+}
+
+/***********************************************************************/
+
+template <typename captype, typename tcaptype, typename flowtype>
+	void GridEnergy<captype,tcaptype,flowtype>::reset(const int* sites, int count, int grid_width)
+{
+	this->sites = sites;
+	this->grid_width = grid_width;
+	var_num = 0;
+	Econst = 0;
+
+	int x0, y0, x1, y1;
+	bounding_box(sites, count, grid_width, x0, y0, x1, y1);
+	GraphT::reset(x1 - x0 + 1, y1 - y0 + 1);
+	nodes_of_vars.resize(count);
+	for (int k = 0; k < count; k++)
+		nodes_of_vars[k] = GraphT::node_at(sites[k] % grid_width - x0, sites[k] / grid_width - y0);
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	void GridEnergy<captype,tcaptype,flowtype>::bounding_box(const int* sites, int count, int grid_width,
+	                                                          int& x0, int& y0, int& x1, int& y1)
+{
+	x0 = grid_width; y0 = 0x7fffffff; x1 = -1; y1 = -1;
+	for (int k = 0; k < count; k++)
+	{
+		int x = sites[k] % grid_width, y = sites[k] / grid_width;
+		if (x < x0) x0 = x;
+		if (x > x1) x1 = x;
+		if (y < y0) y0 = y;
+		if (y > y1) y1 = y;
+	}
+	if (count == 0) x0 = y0 = x1 = y1 = 0;
+}
+
+template <typename captype, typename tcaptype, typename flowtype>
+	inline void GridEnergy<captype,tcaptype,flowtype>::add_term2(Var x, Var y,
+                              Value A, Value B,
+                              Value C, Value D)
+{
+	/* same decomposition as Energy::add_term2() */
+	add_tweights(x, D, A);
+	B -= A; C -= D;
+
+	assert(B + C >= 0); /* check regularity */
+	if (B < 0)
+	{
+		add_tweights(x, 0, B);
+		add_tweights(y, 0, -B);
+		add_edge(x, y, 0, B+C);
+	}
+	else if (C < 0)
+	{
+		add_tweights(x, 0, -C);
+		add_tweights(y, 0, C);
+		add_edge(x, y, B+C, 0);
+	}
+	else /* B >= 0, C >= 0 */
+	{
+		add_edge(x, y, B, C);
+	}
+}
+
+#endif
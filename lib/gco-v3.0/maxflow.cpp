@@ -559,6 +559,7 @@ template <typename captype, typename tcaptype, typename flowtype>
 		}
 
 		TIME ++;
+		if ((TIME & 255) == 0 && interrupt && interrupt->load(std::memory_order_relaxed)) break;
 
 		if (a)
 		{
@@ -593,11 +594,8 @@ template <typename captype, typename tcaptype, typename flowtype>
 	}
 	// test_consistency();
 
-	if (!reuse_trees || (maxflow_iteration % 64) == 0)
-	{
-		delete nodeptr_block; 
-		nodeptr_block = NULL; 
-	}
+	// all orphans were adopted, so every item of nodeptr_block is free again;
+	// it is kept for the next maxflow() instead of being allocated again
 
 	maxflow_iteration ++;
 	return flow;